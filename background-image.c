@@ -1,7 +1,23 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "background-image.h"
 #include "cairo_util.h"
+#include "image-loader.h"
 #include "log.h"
+#include "trace.h"
+
+#define HAVE_NATIVE_LOADER (HAVE_LIBPNG || HAVE_LIBJPEG || HAVE_LIBWEBP)
+
+// Rasters of a vector image kept for reuse, enough for a few output sizes
+#define MAX_SVG_RASTERS 4
 
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
@@ -14,6 +30,8 @@ enum background_mode parse_background_mode(const char *mode) {
 		return BACKGROUND_MODE_CENTER;
 	} else if (strcmp(mode, "tile") == 0) {
 		return BACKGROUND_MODE_TILE;
+	} else if (strcmp(mode, "span") == 0) {
+		return BACKGROUND_MODE_SPAN;
 	} else if (strcmp(mode, "solid_color") == 0) {
 		return BACKGROUND_MODE_SOLID_COLOR;
 	}
@@ -21,105 +39,896 @@ enum background_mode parse_background_mode(const char *mode) {
 	return BACKGROUND_MODE_INVALID;
 }
 
-cairo_surface_t *load_background_image(const char *path) {
-	cairo_surface_t *image;
-#if HAVE_GDK_PIXBUF
-	GError *err = NULL;
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &err);
-	if (!pixbuf) {
-		swaybg_log(LOG_ERROR, "Failed to load background image (%s).",
-				err->message);
+bool parse_image_crop(const char *str, struct image_crop *crop) {
+	struct image_crop result;
+	char end;
+	if (sscanf(str, "%dx%d+%d+%d%c", &result.width, &result.height,
+			&result.x, &result.y, &end) != 4 ||
+			result.width <= 0 || result.height <= 0 ||
+			result.x < 0 || result.y < 0) {
+		return false;
+	}
+	*crop = result;
+	return true;
+}
+
+/*
+ * Map an EXIF orientation tag to the transform taking the stored pixels to
+ * the upright image.
+ */
+enum wl_output_transform parse_exif_orientation(int orientation) {
+	switch (orientation) {
+	case 2:
+		return WL_OUTPUT_TRANSFORM_FLIPPED;
+	case 3:
+		return WL_OUTPUT_TRANSFORM_180;
+	case 4:
+		return WL_OUTPUT_TRANSFORM_FLIPPED_180;
+	case 5:
+		return WL_OUTPUT_TRANSFORM_FLIPPED_90;
+	case 6:
+		return WL_OUTPUT_TRANSFORM_270;
+	case 7:
+		return WL_OUTPUT_TRANSFORM_FLIPPED_270;
+	case 8:
+		return WL_OUTPUT_TRANSFORM_90;
+	default:
+		return WL_OUTPUT_TRANSFORM_NORMAL;
+	}
+}
+
+/*
+ * Returns the smallest factor a width x height image can be scaled by before
+ * rendering without the output of the given mode losing detail.
+ */
+double background_image_min_scale(enum background_mode mode,
+		int width, int height, int buffer_width, int buffer_height) {
+	double scale_x = (double)buffer_width / width;
+	double scale_y = (double)buffer_height / height;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_SPAN:
+		return scale_x > scale_y ? scale_x : scale_y;
+	case BACKGROUND_MODE_FIT:
+		return scale_x < scale_y ? scale_x : scale_y;
+	case BACKGROUND_MODE_CENTER:
+	case BACKGROUND_MODE_TILE:
+	case BACKGROUND_MODE_SOLID_COLOR:
+	case BACKGROUND_MODE_INVALID:
+		break;
+	}
+	return 1;
+}
+
+// Read a file that cannot be mapped, such as a pipe, into memory
+static bool read_image_file(struct image_file *file, int fd) {
+	size_t capacity = 0;
+	file->size = 0;
+	while (true) {
+		if (file->size == capacity) {
+			capacity = capacity ? capacity * 2 : 64 * 1024;
+			uint8_t *data = realloc(file->data, capacity);
+			if (!data) {
+				swaybg_log(LOG_ERROR, "Failed to allocate memory for %s",
+					file->path);
+				return false;
+			}
+			file->data = data;
+		}
+		ssize_t n = read(fd, file->data + file->size, capacity - file->size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			swaybg_log_errno(LOG_ERROR, "Failed to read %s", file->path);
+			return false;
+		} else if (n == 0) {
+			return true;
+		}
+		file->size += n;
+	}
+}
+
+bool image_file_open(struct image_file *file, const char *path) {
+	*file = (struct image_file){ .path = path };
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to open %s", path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		// Start readahead now; decoding will find the pages in cache
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			posix_madvise(data, st.st_size, POSIX_MADV_WILLNEED);
+			file->data = data;
+			file->size = st.st_size;
+			file->mapped = true;
+		}
+	}
+
+	bool ok = file->mapped || read_image_file(file, fd);
+	close(fd);
+	if (!ok) {
+		image_file_close(file);
+	}
+	return ok;
+}
+
+void image_file_close(struct image_file *file) {
+	if (file->mapped) {
+		munmap(file->data, file->size);
+	} else {
+		free(file->data);
+	}
+	*file = (struct image_file){ .path = file->path };
+}
+
+#if HAVE_NATIVE_LOADER
+static struct background_image *load_native_image(
+		const struct image_file *file, const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets) {
+	const uint8_t *magic = file->data;
+	size_t len = file->size;
+	bool png = len >= 8 && memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0;
+	bool jpeg = len >= 3 && memcmp(magic, "\xff\xd8\xff", 3) == 0;
+	bool webp = len >= 12 && memcmp(magic, "RIFF", 4) == 0 &&
+		memcmp(magic + 8, "WEBP", 4) == 0;
+	if (!png && !jpeg && !webp) {
+		return NULL;
+	}
+
+	// The decoders read through stdio, straight out of the mapping
+	FILE *stream = fmemopen(file->data, file->size, "rb");
+	if (!stream) {
+		swaybg_log_errno(LOG_ERROR, "fmemopen failed");
+		return NULL;
+	}
+
+	struct image_sink sink = {
+		.targets = targets,
+		.n_targets = n_targets,
+		.crop = crop,
+	};
+	cairo_surface_t *image = NULL;
+#if HAVE_LIBPNG
+	if (png) {
+		swaybg_trace_begin("load_png_image");
+		image = load_png_image(stream, &sink);
+		swaybg_trace_end("load_png_image");
+	}
+#endif
+#if HAVE_LIBJPEG
+	if (jpeg) {
+		swaybg_trace_begin("load_jpeg_image");
+		image = load_jpeg_image(stream, &sink);
+		swaybg_trace_end("load_jpeg_image");
+	}
+#endif
+#if HAVE_LIBWEBP
+	if (webp) {
+		swaybg_trace_begin("load_webp_image");
+		image = load_webp_image(stream, &sink);
+		swaybg_trace_end("load_webp_image");
+	}
+#endif
+	fclose(stream);
+	if (!image) {
+		return NULL;
+	}
+
+	struct background_image *bg = calloc(1, sizeof(struct background_image));
+	if (!bg) {
+		swaybg_log(LOG_ERROR, "Failed to allocate background image");
+		cairo_surface_destroy(image);
+		return NULL;
+	}
+	bg->surface = image;
+	bg->orientation = sink.orientation;
+	// Surface pixels per decoded pixel, from the same rounding as the surface
+	double scale_x = 1.0 / sink.factor, scale_y = 1.0 / sink.factor;
+	if (sink.resampled) {
+		scale_x = (double)sink.width / sink.region_width;
+		scale_y = (double)sink.height / sink.region_height;
+	}
+	bg->width = sink.crop_box.width * scale_x;
+	bg->height = sink.crop_box.height * scale_y;
+	bg->x = (sink.region_x - sink.crop_box.x) * scale_x;
+	bg->y = (sink.region_y - sink.crop_box.y) * scale_y;
+	int file_width = sink.file_width ? sink.file_width : sink.src_width;
+	bg->detail = (double)sink.src_width / file_width * scale_x;
+	bg->capped = sink.capped;
+	return bg;
+}
+#endif // HAVE_NATIVE_LOADER
+
+#if HAVE_LIBRSVG
+// SVG documents are XML, or gzip compressed XML
+static bool is_svg(const struct image_file *file) {
+	const uint8_t *data = file->data;
+	size_t len = file->size;
+	if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+		return true;
+	}
+	if (len >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) {
+		data += 3;
+		len -= 3;
+	}
+	while (len > 0 && (*data == ' ' || *data == '\t' ||
+			*data == '\r' || *data == '\n')) {
+		++data;
+		--len;
+	}
+	return len > 0 && *data == '<';
+}
+
+static struct background_image *load_vector_image(
+		const struct image_file *file, const struct image_crop *crop) {
+	if (!is_svg(file)) {
 		return NULL;
 	}
-	// Correct for embedded image orientation; typical images are not
-	// rotated and will be handled efficiently
-	GdkPixbuf *oriented = gdk_pixbuf_apply_embedded_orientation(pixbuf);
-	g_object_unref(pixbuf);
-	image = gdk_cairo_image_surface_create_from_pixbuf(oriented);
-	g_object_unref(oriented);
+	double width, height;
+	swaybg_trace_begin("load_svg_image");
+	struct svg_image *svg = load_svg_image(file, crop, &width, &height);
+	swaybg_trace_end("load_svg_image");
+	if (!svg) {
+		return NULL;
+	}
+
+	struct background_image *bg = calloc(1, sizeof(struct background_image));
+	if (!bg) {
+		swaybg_log(LOG_ERROR, "Failed to allocate background image");
+		destroy_svg_image(svg);
+		return NULL;
+	}
+	bg->svg = svg;
+	bg->orientation = WL_OUTPUT_TRANSFORM_NORMAL;
+	bg->width = width;
+	bg->height = height;
+	bg->detail = 1;
+	return bg;
+}
+#endif // HAVE_LIBRSVG
+
+/*
+ * Copy the part of a fully decoded image that `crop` selects. Returns NULL
+ * if it is empty.
+ */
+static cairo_surface_t *crop_image(cairo_surface_t *image,
+		enum wl_output_transform orientation, const struct image_crop *crop) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	cairo_matrix_t matrix;
+	cairo_matrix_init_transform(&matrix, orientation, width, height);
+	cairo_matrix_invert(&matrix);
+	double x0 = crop->x, y0 = crop->y;
+	double x1 = crop->x + crop->width, y1 = crop->y + crop->height;
+	cairo_matrix_transform_point(&matrix, &x0, &y0);
+	cairo_matrix_transform_point(&matrix, &x1, &y1);
+	int left = fmax(fmin(x0, x1), 0), top = fmax(fmin(y0, y1), 0);
+	int right = fmin(fmax(x0, x1), width);
+	int bottom = fmin(fmax(y0, y1), height);
+	if (left >= right || top >= bottom) {
+		return NULL;
+	}
+
+	cairo_surface_t *cropped = cairo_image_surface_create(
+		cairo_image_surface_get_format(image), right - left, bottom - top);
+	cairo_t *cairo = cairo_create(cropped);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cairo, image, -left, -top);
+	cairo_paint(cairo);
+	cairo_destroy(cairo);
+	return cropped;
+}
+
+struct png_stream {
+	const uint8_t *data;
+	size_t remaining;
+};
+
+static cairo_status_t read_png_stream(void *closure, unsigned char *data,
+		unsigned int length) {
+	struct png_stream *stream = closure;
+	if (length > stream->remaining) {
+		return CAIRO_STATUS_READ_ERROR;
+	}
+	memcpy(data, stream->data, length);
+	stream->data += length;
+	stream->remaining -= length;
+	return CAIRO_STATUS_SUCCESS;
+}
+
+struct background_image *load_background_image(const struct image_file *file,
+		const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets) {
+	if (!file->data) {
+		return NULL;
+	}
+#if HAVE_LIBRSVG
+	struct background_image *vector = load_vector_image(file, crop);
+	if (vector) {
+		return vector;
+	}
+#endif // HAVE_LIBRSVG
+#if HAVE_NATIVE_LOADER
+	struct background_image *native = load_native_image(file, crop,
+		targets, n_targets);
+	if (native) {
+		return native;
+	}
+#endif // HAVE_NATIVE_LOADER
+	enum wl_output_transform orientation = WL_OUTPUT_TRANSFORM_NORMAL;
+	cairo_surface_t *image = NULL;
+	// cairo reads PNG images itself, everything else takes gdk-pixbuf
+	bool png = file->size >= 8 &&
+		memcmp(file->data, "\x89PNG\r\n\x1a\n", 8) == 0;
+	if (png) {
+		struct png_stream stream = {
+			.data = file->data,
+			.remaining = file->size,
+		};
+		swaybg_trace_begin("cairo_image_surface_create_from_png_stream");
+		image = cairo_image_surface_create_from_png_stream(read_png_stream,
+			&stream);
+		swaybg_trace_end("cairo_image_surface_create_from_png_stream");
+	} else {
+#if HAVE_GDK_PIXBUF
+		swaybg_trace_begin("load_pixbuf_image");
+		image = load_pixbuf_image(file, &orientation);
+		swaybg_trace_end("load_pixbuf_image");
+		if (!image) {
+			return NULL;
+		}
 #else
-	image = cairo_image_surface_create_from_png(path);
+		swaybg_log(LOG_ERROR, "Failed to read background image: not a PNG."
+				"\nSway was compiled without gdk_pixbuf support, so only"
+				"\nPNG images can be loaded.");
+		return NULL;
 #endif // HAVE_GDK_PIXBUF
+	}
 	if (!image) {
 		swaybg_log(LOG_ERROR, "Failed to read background image.");
 		return NULL;
 	}
 	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
-		swaybg_log(LOG_ERROR, "Failed to read background image: %s."
-#if !HAVE_GDK_PIXBUF
-				"\nSway was compiled without gdk_pixbuf support, so only"
-				"\nPNG images can be loaded. This is the likely cause."
-#endif // !HAVE_GDK_PIXBUF
-				, cairo_status_to_string(cairo_surface_status(image)));
+		swaybg_log(LOG_ERROR, "Failed to read background image: %s.",
+				cairo_status_to_string(cairo_surface_status(image)));
+		cairo_surface_destroy(image);
 		return NULL;
 	}
-	return image;
+	if (crop) {
+		cairo_surface_t *cropped = crop_image(image, orientation, crop);
+		if (cropped) {
+			cairo_surface_destroy(image);
+			image = cropped;
+		}
+	}
+
+	struct background_image *bg = calloc(1, sizeof(struct background_image));
+	if (!bg) {
+		swaybg_log(LOG_ERROR, "Failed to allocate background image");
+		cairo_surface_destroy(image);
+		return NULL;
+	}
+	bg->surface = image;
+	bg->orientation = orientation;
+	bg->width = cairo_image_surface_get_width(image);
+	bg->height = cairo_image_surface_get_height(image);
+	bg->detail = 1;
+	return bg;
 }
 
-void render_background_image(cairo_t *cairo, cairo_surface_t *image,
-		enum background_mode mode, int buffer_width, int buffer_height) {
-	double width = cairo_image_surface_get_width(image);
-	double height = cairo_image_surface_get_height(image);
+void destroy_background_image(struct background_image *image) {
+	if (!image) {
+		return;
+	}
+	destroy_background_image(image->reduced);
+	destroy_background_image(image->rasters);
+	destroy_background_image(image->next);
+	cairo_surface_destroy(image->surface);
+#if HAVE_LIBRSVG
+	destroy_svg_image(image->svg);
+#endif
+	free(image);
+}
 
-	cairo_save(cairo);
+/*
+ * Return the scale and position, in scaled units, of the upright width x
+ * height image rendered in `mode` on a buffer_width x buffer_height buffer.
+ */
+static void place_image(enum background_mode mode, double width,
+		double height, int buffer_width, int buffer_height,
+		double *scale_x, double *scale_y, double *x, double *y) {
+	double window_ratio = (double)buffer_width / buffer_height;
+	double bg_ratio = width / height;
+	*scale_x = *scale_y = 1;
+	*x = *y = 0;
 	switch (mode) {
 	case BACKGROUND_MODE_STRETCH:
-		cairo_scale(cairo,
-				(double)buffer_width / width,
-				(double)buffer_height / height);
-		cairo_set_source_surface(cairo, image, 0, 0);
+		*scale_x = (double)buffer_width / width;
+		*scale_y = (double)buffer_height / height;
 		break;
-	case BACKGROUND_MODE_FILL: {
-		double window_ratio = (double)buffer_width / buffer_height;
-		double bg_ratio = width / height;
-
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_SPAN:
 		if (window_ratio > bg_ratio) {
-			double scale = (double)buffer_width / width;
-			cairo_scale(cairo, scale, scale);
-			cairo_set_source_surface(cairo, image,
-					0, (double)buffer_height / 2 / scale - height / 2);
+			*scale_x = *scale_y = (double)buffer_width / width;
+			*y = (double)buffer_height / 2 / *scale_y - height / 2;
 		} else {
-			double scale = (double)buffer_height / height;
-			cairo_scale(cairo, scale, scale);
-			cairo_set_source_surface(cairo, image,
-					(double)buffer_width / 2 / scale - width / 2, 0);
+			*scale_x = *scale_y = (double)buffer_height / height;
+			*x = (double)buffer_width / 2 / *scale_x - width / 2;
 		}
 		break;
-	}
-	case BACKGROUND_MODE_FIT: {
-		double window_ratio = (double)buffer_width / buffer_height;
-		double bg_ratio = width / height;
-
+	case BACKGROUND_MODE_FIT:
 		if (window_ratio > bg_ratio) {
-			double scale = (double)buffer_height / height;
-			cairo_scale(cairo, scale, scale);
-			cairo_set_source_surface(cairo, image,
-					(double)buffer_width / 2 / scale - width / 2, 0);
+			*scale_x = *scale_y = (double)buffer_height / height;
+			*x = (double)buffer_width / 2 / *scale_x - width / 2;
 		} else {
-			double scale = (double)buffer_width / width;
-			cairo_scale(cairo, scale, scale);
-			cairo_set_source_surface(cairo, image,
-					0, (double)buffer_height / 2 / scale - height / 2);
+			*scale_x = *scale_y = (double)buffer_width / width;
+			*y = (double)buffer_height / 2 / *scale_y - height / 2;
 		}
 		break;
-	}
 	case BACKGROUND_MODE_CENTER:
-		cairo_set_source_surface(cairo, image,
-				(double)buffer_width / 2 - width / 2,
-				(double)buffer_height / 2 - height / 2);
+		*x = (double)buffer_width / 2 - width / 2;
+		*y = (double)buffer_height / 2 - height / 2;
 		break;
-	case BACKGROUND_MODE_TILE: {
-		cairo_pattern_t *pattern = cairo_pattern_create_for_surface(image);
-		cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-		cairo_set_source(cairo, pattern);
-		cairo_pattern_destroy(pattern);
+	case BACKGROUND_MODE_TILE:
 		break;
-	}
 	case BACKGROUND_MODE_SOLID_COLOR:
 	case BACKGROUND_MODE_INVALID:
 		assert(0);
 		break;
 	}
+}
+
+// The size of the image once oriented upright
+static void get_upright_size(const struct background_image *image,
+		double *width, double *height) {
+	*width = image->width;
+	*height = image->height;
+	if (image->orientation & WL_OUTPUT_TRANSFORM_90) {
+		*width = image->height;
+		*height = image->width;
+	}
+}
+
+bool background_image_fits(const struct background_image *image,
+		const struct background_target *targets, size_t n_targets) {
+	if (image->svg) {
+		// Rasterized for each target when rendering
+		return true;
+	}
+	double width, height;
+	get_upright_size(image, &width, &height);
+
+	// The decoded pixels, in upright image coordinates
+	cairo_matrix_t orientation;
+	cairo_matrix_init_transform(&orientation, image->orientation,
+		image->width, image->height);
+	double sx0 = image->x, sy0 = image->y;
+	double sx1 = image->x + cairo_image_surface_get_width(image->surface);
+	double sy1 = image->y + cairo_image_surface_get_height(image->surface);
+	cairo_matrix_transform_point(&orientation, &sx0, &sy0);
+	cairo_matrix_transform_point(&orientation, &sx1, &sy1);
+
+	for (size_t i = 0; i < n_targets; ++i) {
+		const struct background_target *target = &targets[i];
+		double scale_x, scale_y, x, y;
+		place_image(target->mode, width, height,
+			target->width, target->height, &scale_x, &scale_y, &x, &y);
+		if (image->detail < 1 && !image->capped &&
+				fmax(scale_x, scale_y) > 1.001) {
+			// Decoding again would give more detail
+			return false;
+		}
+
+		// What the target shows, and a pixel around it for the filter. Tiles
+		// repeat only when the image is smaller than the target, which
+		// makes that all of it.
+		double x0 = fmax(-x - 1, 0);
+		double y0 = fmax(-y - 1, 0);
+		double x1 = fmin(target->width / scale_x - x + 1, width);
+		double y1 = fmin(target->height / scale_y - y + 1, height);
+		if (x0 < fmin(sx0, sx1) || x1 > fmax(sx0, sx1) ||
+				y0 < fmin(sy0, sy1) || y1 > fmax(sy0, sy1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Average 2x2 blocks of pixels, the last row and column repeating if odd
+static cairo_surface_t *reduce_surface(cairo_surface_t *surface) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	cairo_surface_t *reduced = cairo_image_surface_create(
+		cairo_image_surface_get_format(surface),
+		(width + 1) / 2, (height + 1) / 2);
+	if (cairo_surface_status(reduced) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(reduced);
+		return NULL;
+	}
+	int reduced_width = cairo_image_surface_get_width(reduced);
+	int reduced_height = cairo_image_surface_get_height(reduced);
+	int reduced_stride = cairo_image_surface_get_stride(reduced);
+	cairo_surface_flush(surface);
+	cairo_surface_flush(reduced);
+	const uint8_t *data = cairo_image_surface_get_data(surface);
+	uint8_t *reduced_data = cairo_image_surface_get_data(reduced);
+
+	for (int y = 0; y < reduced_height; ++y) {
+		const uint32_t *row0 = (const uint32_t *)(data +
+			(size_t)(2 * y) * stride);
+		const uint32_t *row1 = 2 * y + 1 < height ?
+			(const uint32_t *)((const uint8_t *)row0 + stride) : row0;
+		uint32_t *dst = (uint32_t *)(reduced_data + (size_t)y * reduced_stride);
+		for (int x = 0; x < reduced_width; ++x) {
+			int x1 = 2 * x + 1 < width ? 2 * x + 1 : 2 * x;
+			uint32_t p[4] = { row0[2 * x], row0[x1], row1[2 * x], row1[x1] };
+			// Two channels per 16-bit lane, four sums still fit
+			uint32_t rb = 0x00020002, ag = 0x00020002;
+			for (int i = 0; i < 4; ++i) {
+				rb += p[i] & 0x00FF00FF;
+				ag += (p[i] >> 8) & 0x00FF00FF;
+			}
+			dst[x] = ((ag >> 2) & 0x00FF00FF) << 8 | ((rb >> 2) & 0x00FF00FF);
+		}
+	}
+	cairo_surface_mark_dirty(reduced);
+	return reduced;
+}
+
+/*
+ * Return the mipmap level of `image` to sample when drawing it at `scale`:
+ * the smallest that still has a pixel for every buffer pixel.
+ */
+static struct background_image *get_level(struct background_image *image,
+		double scale) {
+	while (scale <= 0.5 &&
+			cairo_image_surface_get_width(image->surface) > 1 &&
+			cairo_image_surface_get_height(image->surface) > 1) {
+		if (!image->reduced) {
+			swaybg_trace_begin("reduce_surface");
+			cairo_surface_t *surface = reduce_surface(image->surface);
+			swaybg_trace_end("reduce_surface");
+			struct background_image *reduced = surface ?
+				calloc(1, sizeof(struct background_image)) : NULL;
+			if (!reduced) {
+				cairo_surface_destroy(surface);
+				break;
+			}
+			*reduced = (struct background_image){
+				.surface = surface,
+				.orientation = image->orientation,
+				.width = image->width / 2,
+				.height = image->height / 2,
+				.x = image->x / 2,
+				.y = image->y / 2,
+				.detail = image->detail / 2,
+			};
+			image->reduced = reduced;
+		}
+		image = image->reduced;
+		scale *= 2;
+	}
+	return image;
+}
+
+#if HAVE_LIBRSVG
+/*
+ * Return a raster of the vector `image` with one pixel per buffer pixel, of
+ * the part of a buffer_width x buffer_height buffer in `mode` that `cairo`
+ * draws to. In span mode, that is only this output's part.
+ */
+static struct background_image *get_raster(cairo_t *cairo,
+		struct background_image *image, enum background_mode mode,
+		int buffer_width, int buffer_height) {
+	double scale_x, scale_y, x, y;
+	place_image(mode, image->width, image->height,
+		buffer_width, buffer_height, &scale_x, &scale_y, &x, &y);
+	double width = image->width * scale_x;
+	double height = image->height * scale_y;
+	// Where the scaled image lies in the buffer, and the buffer pixels it
+	// covers
+	double left = x * scale_x, top = y * scale_y;
+	int x0, y0, x1, y1;
+	if (mode == BACKGROUND_MODE_TILE) {
+		// Every tile is shown, at a whole number of pixels
+		width = x1 = fmax(round(width), 1);
+		height = y1 = fmax(round(height), 1);
+		left = top = x0 = y0 = 0;
+	} else {
+		double clip_x0, clip_y0, clip_x1, clip_y1;
+		cairo_clip_extents(cairo, &clip_x0, &clip_y0, &clip_x1, &clip_y1);
+		x0 = fmax(floor(fmax(left, clip_x0)), 0);
+		y0 = fmax(floor(fmax(top, clip_y0)), 0);
+		x1 = fmin(ceil(fmin(left + width, clip_x1)), buffer_width);
+		y1 = fmin(ceil(fmin(top + height, clip_y1)), buffer_height);
+		if (x0 >= x1 || y0 >= y1) {
+			return NULL;
+		}
+	}
+
+	struct background_image **link = &image->rasters;
+	while (*link) {
+		struct background_image *raster = *link;
+		if (raster->width == width && raster->height == height &&
+				raster->x == x0 - left && raster->y == y0 - top &&
+				cairo_image_surface_get_width(raster->surface) == x1 - x0 &&
+				cairo_image_surface_get_height(raster->surface) == y1 - y0) {
+			*link = raster->next;
+			raster->next = image->rasters;
+			image->rasters = raster;
+			return raster;
+		}
+		link = &raster->next;
+	}
+
+	swaybg_trace_begin("render_svg_image");
+	cairo_surface_t *surface = render_svg_image(image->svg, x1 - x0, y1 - y0,
+		x0 - left, y0 - top, width, height);
+	swaybg_trace_end("render_svg_image");
+	struct background_image *raster = surface ?
+		calloc(1, sizeof(struct background_image)) : NULL;
+	if (!raster) {
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	*raster = (struct background_image){
+		.surface = surface,
+		.orientation = WL_OUTPUT_TRANSFORM_NORMAL,
+		.width = width,
+		.height = height,
+		.x = x0 - left,
+		.y = y0 - top,
+		.detail = 1,
+		.next = image->rasters,
+	};
+	image->rasters = raster;
+
+	// Drop the least recently used
+	size_t n = 1;
+	for (struct background_image *r = raster; r->next; r = r->next) {
+		if (++n > MAX_SVG_RASTERS) {
+			destroy_background_image(r->next);
+			r->next = NULL;
+			break;
+		}
+	}
+	return raster;
+}
+#endif // HAVE_LIBRSVG
+
+// Use the upright image as source, with its top-left corner at x, y
+static void set_source_image(cairo_t *cairo,
+		const struct background_image *image, double x, double y) {
+	cairo_matrix_t orientation;
+	cairo_matrix_init_transform(&orientation, image->orientation,
+		image->width, image->height);
+	cairo_translate(cairo, x, y);
+	cairo_transform(cairo, &orientation);
+	cairo_translate(cairo, image->x, image->y);
+	cairo_set_source_surface(cairo, image->surface, 0, 0);
+}
+
+/*
+ * Tile mode without cairo's per-pixel pattern sampling. When the current
+ * matrix maps image pixels onto whole buffer pixels, render a single tile in
+ * buffer orientation, then replicate it with memcpy: each row is widened by
+ * doubling, and the tile rows by doubling whole blocks of rows. Returns
+ * false when this does not apply and cairo has to draw.
+ */
+static bool render_tiles(cairo_t *cairo, cairo_surface_t *image,
+		uint32_t background) {
+	cairo_surface_t *target = cairo_get_target(cairo);
+	if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE) {
+		return false;
+	}
+	cairo_format_t format = cairo_image_surface_get_format(target);
+	if (format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_ARGB32) {
+		return false;
+	}
+	double dx, dy;
+	cairo_surface_get_device_offset(target, &dx, &dy);
+	if (dx != 0 || dy != 0) {
+		return false;
+	}
+
+	// Only flips, 90 degree rotations and whole pixel offsets qualify
+	cairo_matrix_t m;
+	cairo_get_matrix(cairo, &m);
+	bool straight = m.xy == 0 && m.yx == 0 &&
+		fabs(m.xx) == 1 && fabs(m.yy) == 1;
+	bool rotated = m.xx == 0 && m.yy == 0 &&
+		fabs(m.xy) == 1 && fabs(m.yx) == 1;
+	if ((!straight && !rotated) ||
+			m.x0 != floor(m.x0) || m.y0 != floor(m.y0)) {
+		return false;
+	}
+
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int tile_width = rotated ? height : width;
+	int tile_height = rotated ? width : height;
+	int buffer_width = cairo_image_surface_get_width(target);
+	int buffer_height = cairo_image_surface_get_height(target);
+	if ((int64_t)tile_width * tile_height >=
+			(int64_t)buffer_width * buffer_height) {
+		// Nothing to replicate, a plain paint is as cheap
+		return false;
+	}
+
+	cairo_surface_t *tile = cairo_image_surface_create(format,
+		tile_width, tile_height);
+	if (cairo_surface_status(tile) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(tile);
+		return false;
+	}
+
+	cairo_surface_flush(target);
+	uint8_t *data = cairo_image_surface_get_data(target);
+	int stride = cairo_image_surface_get_stride(target);
+	uint8_t *tile_data = cairo_image_surface_get_data(tile);
+	int tile_stride = cairo_image_surface_get_stride(tile);
+
+	if (cairo_surface_get_content(image) != CAIRO_CONTENT_COLOR) {
+		// Compose over the background color, the same operation painting
+		// each tile over it would do
+		cairo_image_surface_fill(tile, 0, 0, tile_width, tile_height,
+			background);
+		cairo_surface_mark_dirty(tile);
+	}
+
+	// Buffer position of the tile's top-left corner, and the tiling's phase
+	// at the buffer origin
+	int x0 = m.x0 + fmin(0, m.xx * width) + fmin(0, m.xy * height);
+	int y0 = m.y0 + fmin(0, m.yx * width) + fmin(0, m.yy * height);
+	int phase_x = ((-x0 % tile_width) + tile_width) % tile_width;
+	int phase_y = ((-y0 % tile_height) + tile_height) % tile_height;
+
+	cairo_t *tile_cairo = cairo_create(tile);
+	cairo_matrix_t tile_matrix = m;
+	tile_matrix.x0 -= x0;
+	tile_matrix.y0 -= y0;
+	cairo_set_matrix(tile_cairo, &tile_matrix);
+	cairo_set_source_surface(tile_cairo, image, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(tile_cairo), CAIRO_FILTER_NEAREST);
+	cairo_paint(tile_cairo);
+	cairo_destroy(tile_cairo);
+	cairo_surface_flush(tile);
+
+	int rows = tile_height < buffer_height ? tile_height : buffer_height;
+	for (int y = 0; y < rows; ++y) {
+		uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+		const uint32_t *src = (const uint32_t *)(tile_data +
+			(size_t)((phase_y + y) % tile_height) * tile_stride);
+
+		// One period starting at the phase, then doubled up to the width
+		int n = tile_width - phase_x;
+		if (n > buffer_width) {
+			n = buffer_width;
+		}
+		memcpy(row, src + phase_x, n * sizeof(uint32_t));
+		if (n < buffer_width) {
+			int wrap = buffer_width - n < phase_x ? buffer_width - n : phase_x;
+			memcpy(row + n, src, wrap * sizeof(uint32_t));
+			n += wrap;
+		}
+		while (n < buffer_width) {
+			int copy = buffer_width - n < n ? buffer_width - n : n;
+			memcpy(row + n, row, copy * sizeof(uint32_t));
+			n += copy;
+		}
+	}
+	// Rows are periodic too, so double whole blocks of them
+	for (int y = rows; y < buffer_height;) {
+		int copy = buffer_height - y < y ? buffer_height - y : y;
+		memcpy(data + (size_t)y * stride, data, (size_t)copy * stride);
+		y += copy;
+	}
+
+	cairo_surface_destroy(tile);
+	cairo_surface_mark_dirty(target);
+	return true;
+}
+
+/*
+ * Fill the background under the image source set on `cairo`, except where
+ * painting it will overwrite every pixel anyway: inside an opaque image,
+ * minus a margin for the filter to blend its edges with.
+ */
+static void fill_background(cairo_t *cairo, cairo_surface_t *image,
+		uint32_t background) {
+	cairo_surface_t *target = cairo_get_target(cairo);
+	int width = cairo_image_surface_get_width(target);
+	int height = cairo_image_surface_get_height(target);
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0; // opaque area in buffer pixels
+
+	cairo_matrix_t m;
+	cairo_get_matrix(cairo, &m);
+	bool axis_aligned = (m.xy == 0 && m.yx == 0) || (m.xx == 0 && m.yy == 0);
+	if (cairo_surface_get_content(image) == CAIRO_CONTENT_COLOR &&
+			axis_aligned) {
+		double ax = 0, ay = 0;
+		double bx = cairo_image_surface_get_width(image);
+		double by = cairo_image_surface_get_height(image);
+		cairo_user_to_device(cairo, &ax, &ay);
+		cairo_user_to_device(cairo, &bx, &by);
+		int margin = ceil(fmax(fabs(m.xx), fabs(m.xy))) + 1;
+		x0 = ceil(fmax(fmin(ax, bx), 0)) + margin;
+		y0 = ceil(fmax(fmin(ay, by), 0)) + margin;
+		x1 = floor(fmin(fmax(ax, bx), width)) - margin;
+		y1 = floor(fmin(fmax(ay, by), height)) - margin;
+	}
+	if (x0 >= x1 || y0 >= y1) {
+		x0 = y0 = x1 = y1 = 0;
+	}
+
+	cairo_surface_flush(target);
+	cairo_image_surface_fill(target, 0, 0, width, y0, background);
+	cairo_image_surface_fill(target, 0, y0, x0, y1 - y0, background);
+	cairo_image_surface_fill(target, x1, y0, width - x1, y1 - y0, background);
+	cairo_image_surface_fill(target, 0, y1, width, height - y1, background);
+	cairo_surface_mark_dirty(target);
+}
+
+void render_background_image(cairo_t *cairo,
+		struct background_image *image, enum background_mode mode,
+		uint32_t bg_color, int buffer_width, int buffer_height,
+		cairo_filter_t filter) {
+	uint32_t background = cairo_pixel_from_u32(bg_color);
+#if HAVE_LIBRSVG
+	if (image->svg) {
+		image = get_raster(cairo, image, mode, buffer_width, buffer_height);
+		if (!image) {
+			cairo_save(cairo);
+			cairo_set_source_u32(cairo, bg_color);
+			cairo_paint(cairo);
+			cairo_restore(cairo);
+			return;
+		}
+	}
+#endif // HAVE_LIBRSVG
+	double width, height, scale_x, scale_y, x, y;
+	get_upright_size(image, &width, &height);
+	place_image(mode, width, height, buffer_width, buffer_height,
+		&scale_x, &scale_y, &x, &y);
+
+	struct background_image *level = get_level(image,
+		fmax(scale_x, scale_y));
+	if (level != image) {
+		image = level;
+		get_upright_size(image, &width, &height);
+		place_image(mode, width, height, buffer_width, buffer_height,
+			&scale_x, &scale_y, &x, &y);
+	}
+
+	cairo_save(cairo);
+	cairo_scale(cairo, scale_x, scale_y);
+	set_source_image(cairo, image, x, y);
+	cairo_pattern_set_filter(cairo_get_source(cairo), filter);
+	if (mode == BACKGROUND_MODE_TILE) {
+		if (render_tiles(cairo, image->surface, background)) {
+			cairo_restore(cairo);
+			return;
+		}
+		cairo_pattern_set_extend(cairo_get_source(cairo), CAIRO_EXTEND_REPEAT);
+	}
+	if (mode == BACKGROUND_MODE_TILE) {
+		// Repeating, the image's own bounds are not what it covers
+		cairo_surface_t *target = cairo_get_target(cairo);
+		cairo_surface_flush(target);
+		cairo_image_surface_fill(target, 0, 0,
+			cairo_image_surface_get_width(target),
+			cairo_image_surface_get_height(target), background);
+		cairo_surface_mark_dirty(target);
+	} else {
+		fill_background(cairo, image->surface, background);
+	}
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 }
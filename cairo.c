@@ -1,9 +1,7 @@
 #include <stdint.h>
+#include <string.h>
 #include <cairo.h>
 #include "cairo_util.h"
-#if HAVE_GDK_PIXBUF
-#include <gdk-pixbuf/gdk-pixbuf.h>
-#endif
 
 void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
 	cairo_set_source_rgba(cairo,
@@ -13,6 +11,43 @@ void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
 			(color >> (0*8) & 0xFF) / 255.0);
 }
 
+uint32_t cairo_pixel_from_u32(uint32_t color) {
+	// Premultiply with the same rounding as cairo_set_source_u32() + paint
+	double a = (color & 0xFF) / 255.0;
+	uint32_t pixel = (color & 0xFF) << 24;
+	for (int shift = 8; shift < 32; shift += 8) {
+		double c = (color >> shift & 0xFF) / 255.0;
+		pixel |= ((uint32_t)(c * a * 65535.0 + 0.5) >> 8) << (shift - 8);
+	}
+	return pixel;
+}
+
+// Eight pixels, so that fills compile to wide stores on any target
+typedef uint32_t pixels __attribute__((vector_size(32)));
+
+void fill_pixels(uint32_t *data, size_t n, uint32_t pixel) {
+	pixels v = (pixels){0} + pixel;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		memcpy(data + i, &v, sizeof(v));
+	}
+	for (; i < n; ++i) {
+		data[i] = pixel;
+	}
+}
+
+void cairo_image_surface_fill(cairo_surface_t *surface,
+		int x, int y, int width, int height, uint32_t pixel) {
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	uint8_t *data = cairo_image_surface_get_data(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	for (int i = y; i < y + height; ++i) {
+		fill_pixels((uint32_t *)(data + (size_t)i * stride) + x, width, pixel);
+	}
+}
+
 cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel) {
 	switch (subpixel) {
 	case WL_OUTPUT_SUBPIXEL_HORIZONTAL_RGB:
@@ -29,20 +64,47 @@ cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel)
 	return CAIRO_SUBPIXEL_ORDER_DEFAULT;
 }
 
-#if HAVE_GDK_PIXBUF
-cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdkbuf) {
-	int chan = gdk_pixbuf_get_n_channels(gdkbuf);
-	if (chan < 3) {
-		return NULL;
+/*
+ * Set `matrix` to map coordinates in a width x height space to the same space
+ * after applying `transform`, following the wl_surface buffer transform
+ * convention.
+ */
+void cairo_matrix_init_transform(cairo_matrix_t *matrix,
+		enum wl_output_transform transform, double width, double height) {
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		cairo_matrix_init_identity(matrix);
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		cairo_matrix_init(matrix, 0, -1, 1, 0, 0, width);
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		cairo_matrix_init(matrix, -1, 0, 0, -1, width, height);
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		cairo_matrix_init(matrix, 0, 1, -1, 0, height, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		cairo_matrix_init(matrix, -1, 0, 0, 1, width, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		cairo_matrix_init(matrix, 0, 1, 1, 0, 0, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		cairo_matrix_init(matrix, 1, 0, 0, -1, 0, height);
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		cairo_matrix_init(matrix, 0, -1, -1, 0, height, width);
+		break;
 	}
+}
 
-	const guint8* gdkpix = gdk_pixbuf_read_pixels(gdkbuf);
-	if (!gdkpix) {
+#if HAVE_GDK_PIXBUF
+cairo_surface_t *cairo_image_surface_create_from_pixbuf_data(
+		const uint8_t *gdkpix, int chan, int w, int h, int stride) {
+	if (chan < 3) {
 		return NULL;
 	}
-	gint w = gdk_pixbuf_get_width(gdkbuf);
-	gint h = gdk_pixbuf_get_height(gdkbuf);
-	int stride = gdk_pixbuf_get_rowstride(gdkbuf);
 
 	cairo_format_t fmt = (chan == 3) ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
 	cairo_surface_t * cs = cairo_image_surface_create (fmt, w, h);
@@ -57,11 +119,11 @@ cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdk
 	if (chan == 3) {
 		int i;
 		for (i = h; i; --i) {
-			const guint8 *gp = gdkpix;
+			const uint8_t *gp = gdkpix;
 			unsigned char *cp = cpix;
-			const guint8* end = gp + 3*w;
+			const uint8_t* end = gp + 3*w;
 			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 				cp[0] = gp[2];
 				cp[1] = gp[1];
 				cp[2] = gp[0];
@@ -92,16 +154,15 @@ cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdk
 		 * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
 		 */
 #define PREMUL_ALPHA(x,a,b,z) \
-		G_STMT_START { z = a * b + 0x80; x = (z + (z >> 8)) >> 8; } \
-		G_STMT_END
+		do { z = a * b + 0x80; x = (z + (z >> 8)) >> 8; } while (0)
 		int i;
 		for (i = h; i; --i) {
-			const guint8 *gp = gdkpix;
+			const uint8_t *gp = gdkpix;
 			unsigned char *cp = cpix;
-			const guint8* end = gp + 4*w;
-			guint z1, z2, z3;
+			const uint8_t* end = gp + 4*w;
+			unsigned int z1, z2, z3;
 			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 				PREMUL_ALPHA(cp[0], gp[2], gp[3], z1);
 				PREMUL_ALPHA(cp[1], gp[1], gp[3], z2);
 				PREMUL_ALPHA(cp[2], gp[0], gp[3], z3);
@@ -0,0 +1,78 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config-file.h"
+#include "log.h"
+
+// Strip leading and trailing whitespace in place
+static char *strip(char *str) {
+	while (isspace((unsigned char)*str)) {
+		++str;
+	}
+	size_t len = strlen(str);
+	while (len > 0 && isspace((unsigned char)str[len - 1])) {
+		str[--len] = '\0';
+	}
+	return str;
+}
+
+bool config_file_load(const char *path, config_file_handler_t handler,
+		void *data) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		swaybg_log_errno(LOG_ERROR, "Failed to open config %s", path);
+		return false;
+	}
+
+	char *section = strdup("*");
+	char *buf = NULL;
+	size_t size = 0;
+	int line_number = 0;
+	while (section && getline(&buf, &size, f) >= 0) {
+		++line_number;
+		char *line = strip(buf);
+		if (*line == '\0' || *line == '#') {
+			continue;
+		}
+
+		if (*line == '[') {
+			char *end = strrchr(line, ']');
+			if (!end || end[1] != '\0') {
+				swaybg_log(LOG_ERROR, "%s:%d: Missing ] after section name",
+					path, line_number);
+				continue;
+			}
+			*end = '\0';
+			char *output = strip(line + 1);
+			if (*output == '\0') {
+				swaybg_log(LOG_ERROR, "%s:%d: Empty section name",
+					path, line_number);
+				continue;
+			}
+			free(section);
+			section = strdup(output);
+			continue;
+		}
+
+		char *eq = strchr(line, '=');
+		if (!eq) {
+			swaybg_log(LOG_ERROR, "%s:%d: Expected key = value",
+				path, line_number);
+			continue;
+		}
+		*eq = '\0';
+		char *key = strip(line), *value = strip(eq + 1);
+		if (!handler(section, key, value, data)) {
+			swaybg_log(LOG_ERROR, "%s:%d: Ignoring invalid %s = %s",
+				path, line_number, key, value);
+		}
+	}
+	if (!section) {
+		swaybg_log(LOG_ERROR, "Failed to allocate config section");
+	}
+	free(section);
+	free(buf);
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,452 @@
+#define _GNU_SOURCE // memfd_create
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "decode-helper.h"
+#include "log.h"
+#include "trace.h"
+
+#if HAVE_MEMFD
+#define REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+// More than any compositor has outputs, to reject garbage requests
+#define MAX_HELPER_TARGETS 65536
+
+extern char **environ;
+
+// Everything about the decoded image but its pixels
+struct helper_reply {
+	bool vector; // nothing to send, parsing it again here is cheap
+	int surface_width, surface_height, stride;
+	cairo_format_t format;
+	enum wl_output_transform orientation;
+	double width, height;
+	double x, y;
+	double detail;
+	bool capped;
+};
+
+struct pixel_mapping {
+	void *data;
+	size_t size;
+};
+
+static const cairo_user_data_key_t mapping_key;
+
+static bool write_all(int fd, const void *data, size_t size) {
+	const uint8_t *p = data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+	uint8_t *p = data;
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+/*
+ * Sent to the helper along with a sealed memfd holding the file's bytes,
+ * followed by the path, for messages, and the targets
+ */
+struct helper_request {
+	size_t file_size;
+	size_t path_size; // including the terminator
+	bool cropped;
+	struct image_crop crop;
+	size_t n_targets;
+};
+
+static bool send_all(int fd, const void *data, size_t size) {
+	const uint8_t *p = data;
+	while (size > 0) {
+		// Failing rather than raising SIGPIPE if the helper died
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+// Send `data`, with `fd` attached if not negative
+static bool send_message(int sock, const void *data, size_t size, int fd) {
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = {0};
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	if (fd >= 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	// The file descriptor went with the first byte
+	return n >= 0 && send_all(sock, (const uint8_t *)data + n, size - n);
+}
+
+// Receive `size` bytes of data, and the fd sent along or -1
+static bool receive_message(int sock, void *data, size_t size, int *fd) {
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	*fd = -1;
+	if (n <= 0) {
+		return false;
+	}
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+				cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	if (!read_all(sock, (uint8_t *)data + n, size - n)) {
+		if (*fd >= 0) {
+			close(*fd);
+			*fd = -1;
+		}
+		return false;
+	}
+	return true;
+}
+
+// A sealed memfd holding a copy of `data`, or -1
+static int create_sealed_memfd(const char *name, const void *data,
+		size_t size) {
+	int memfd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		swaybg_log_errno(LOG_ERROR, "memfd_create failed");
+		return -1;
+	}
+	if (!write_all(memfd, data, size)) {
+		swaybg_log_errno(LOG_ERROR, "Failed to write %s", name);
+		close(memfd);
+		return -1;
+	}
+	if (fcntl(memfd, F_ADD_SEALS, REQUIRED_SEALS) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to seal %s", name);
+		close(memfd);
+		return -1;
+	}
+	return memfd;
+}
+
+// Whether `memfd` is sealed and holds exactly `size` bytes
+static bool check_sealed_memfd(int memfd, size_t size) {
+	struct stat st;
+	return (fcntl(memfd, F_GET_SEALS) & REQUIRED_SEALS) == REQUIRED_SEALS &&
+		fstat(memfd, &st) == 0 && (size_t)st.st_size == size;
+}
+
+/*
+ * Hand the helper the bytes already read, rather than the path, which may
+ * not be a file it can read again, e.g. a pipe
+ */
+static bool send_request(int sock, const struct image_file *file,
+		const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets) {
+	int memfd = create_sealed_memfd("swaybg-file", file->data, file->size);
+	if (memfd < 0) {
+		return false;
+	}
+	struct helper_request request = {
+		.file_size = file->size,
+		.path_size = strlen(file->path) + 1,
+		.cropped = crop != NULL,
+		.crop = crop ? *crop : (struct image_crop){0},
+		.n_targets = n_targets,
+	};
+	bool ok = send_message(sock, &request, sizeof(request), memfd) &&
+		send_all(sock, file->path, request.path_size) &&
+		send_all(sock, targets, n_targets * sizeof(*targets));
+	close(memfd);
+	return ok;
+}
+
+int decode_helper_main(void) {
+	int sock = STDIN_FILENO;
+	struct helper_request request;
+	int file_fd;
+	if (!receive_message(sock, &request, sizeof(request), &file_fd) ||
+			file_fd < 0 || request.file_size == 0 ||
+			!check_sealed_memfd(file_fd, request.file_size) ||
+			request.path_size == 0 || request.path_size > PATH_MAX ||
+			request.n_targets > MAX_HELPER_TARGETS) {
+		swaybg_log(LOG_ERROR, "Decode helper got an invalid request");
+		return EXIT_FAILURE;
+	}
+	char *path = malloc(request.path_size);
+	struct background_target *targets =
+		calloc(request.n_targets + 1, sizeof(*targets));
+	if (!path || !targets ||
+			!read_all(sock, path, request.path_size) ||
+			!read_all(sock, targets, request.n_targets * sizeof(*targets))) {
+		swaybg_log(LOG_ERROR, "Decode helper failed to read its request");
+		return EXIT_FAILURE;
+	}
+	path[request.path_size - 1] = '\0';
+
+	void *data = mmap(NULL, request.file_size, PROT_READ, MAP_PRIVATE,
+		file_fd, 0);
+	if (data == MAP_FAILED) {
+		swaybg_log_errno(LOG_ERROR, "Failed to map %s", path);
+		return EXIT_FAILURE;
+	}
+	struct image_file file = {
+		.path = path,
+		.data = data,
+		.size = request.file_size,
+		.mapped = true,
+	};
+	struct background_image *bg = load_background_image(&file,
+		request.cropped ? &request.crop : NULL, targets, request.n_targets);
+	if (!bg) {
+		return EXIT_FAILURE;
+	}
+
+	struct helper_reply reply = { .vector = bg->svg != NULL };
+	int memfd = -1;
+	if (!reply.vector) {
+		cairo_surface_t *surface = bg->surface;
+		cairo_surface_flush(surface);
+		reply = (struct helper_reply){
+			.surface_width = cairo_image_surface_get_width(surface),
+			.surface_height = cairo_image_surface_get_height(surface),
+			.stride = cairo_image_surface_get_stride(surface),
+			.format = cairo_image_surface_get_format(surface),
+			.orientation = bg->orientation,
+			.width = bg->width,
+			.height = bg->height,
+			.x = bg->x,
+			.y = bg->y,
+			.detail = bg->detail,
+			.capped = bg->capped,
+		};
+		memfd = create_sealed_memfd("swaybg-image",
+			cairo_image_surface_get_data(surface),
+			(size_t)reply.stride * reply.surface_height);
+		if (memfd < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	// Exit without freeing anything, the process is done
+	return send_message(sock, &reply, sizeof(reply), memfd) ?
+		EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Run swaybg again as the helper, with `sock` as its standard input. It is
+ * exec'd rather than forked, as a fork of this multithreaded process could
+ * inherit a lock another thread holds, e.g. in malloc or cairo.
+ */
+static pid_t spawn_helper(int sock) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	if (posix_spawn_file_actions_init(&actions) != 0) {
+		return -1;
+	}
+	if (posix_spawnattr_init(&attr) != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return -1;
+	}
+	// The signals blocked here for signalfds are not for the helper
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawn_file_actions_adddup2(&actions, sock, STDIN_FILENO);
+
+	char *argv[] = { "swaybg", DECODE_HELPER_ARG, NULL };
+	pid_t pid;
+	int err = posix_spawn(&pid, "/proc/self/exe", &actions, &attr,
+		argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err != 0) {
+		errno = err;
+		swaybg_log_errno(LOG_ERROR, "Failed to start the decode helper");
+		return -1;
+	}
+	return pid;
+}
+
+static void unmap_pixels(void *data) {
+	struct pixel_mapping *mapping = data;
+	munmap(mapping->data, mapping->size);
+	free(mapping);
+}
+
+/*
+ * Wrap the pixels in `memfd` in an image surface. The mapping is read-only,
+ * which is fine as decoded images are only ever used as a source.
+ */
+static cairo_surface_t *map_pixels(int memfd,
+		const struct helper_reply *reply) {
+	size_t size = (size_t)reply->stride * reply->surface_height;
+	if ((reply->format != CAIRO_FORMAT_ARGB32 &&
+				reply->format != CAIRO_FORMAT_RGB24) ||
+			reply->stride != cairo_format_stride_for_width(reply->format,
+				reply->surface_width) ||
+			!check_sealed_memfd(memfd, size)) {
+		swaybg_log(LOG_ERROR, "Decode helper returned an invalid image");
+		return NULL;
+	}
+
+	struct pixel_mapping *mapping = calloc(1, sizeof(struct pixel_mapping));
+	if (!mapping) {
+		swaybg_log(LOG_ERROR, "Failed to allocate pixel mapping");
+		return NULL;
+	}
+	mapping->size = size;
+	mapping->data = mmap(NULL, size, PROT_READ, MAP_SHARED, memfd, 0);
+	if (mapping->data == MAP_FAILED) {
+		swaybg_log_errno(LOG_ERROR, "Failed to map decoded image");
+		free(mapping);
+		return NULL;
+	}
+
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+		mapping->data, reply->format, reply->surface_width,
+		reply->surface_height, reply->stride);
+	if (cairo_surface_set_user_data(surface, &mapping_key, mapping,
+			unmap_pixels) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		unmap_pixels(mapping);
+		return NULL;
+	}
+	return surface;
+}
+#endif // HAVE_MEMFD
+
+struct background_image *load_background_image_isolated(
+		const struct image_file *file, const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets) {
+#if HAVE_MEMFD
+	if (!file->data) {
+		return NULL;
+	}
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		swaybg_log_errno(LOG_ERROR, "socketpair failed");
+		return NULL;
+	}
+
+	swaybg_trace_begin("decode_helper");
+	pid_t pid = spawn_helper(fds[1]);
+	close(fds[1]);
+	struct helper_reply reply;
+	int memfd = -1;
+	bool replied = pid > 0 &&
+		send_request(fds[0], file, crop, targets, n_targets) &&
+		receive_message(fds[0], &reply, sizeof(reply), &memfd);
+	close(fds[0]);
+	int status = 0;
+	if (pid > 0) {
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+			// retry
+		}
+	}
+	swaybg_trace_end("decode_helper");
+	if (!replied || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != EXIT_SUCCESS ||
+			(!reply.vector && memfd < 0)) {
+		// A crashing decoder takes only the helper down
+		swaybg_log(LOG_ERROR, "Decode helper failed for %s", file->path);
+		if (memfd >= 0) {
+			close(memfd);
+		}
+		return NULL;
+	}
+
+	if (reply.vector) {
+		if (memfd >= 0) {
+			close(memfd);
+		}
+		return load_background_image(file, crop, targets, n_targets);
+	}
+	cairo_surface_t *surface = map_pixels(memfd, &reply);
+	close(memfd);
+	if (!surface) {
+		return NULL;
+	}
+
+	struct background_image *bg = calloc(1, sizeof(struct background_image));
+	if (!bg) {
+		swaybg_log(LOG_ERROR, "Failed to allocate background image");
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	bg->surface = surface;
+	bg->orientation = reply.orientation;
+	bg->width = reply.width;
+	bg->height = reply.height;
+	bg->x = reply.x;
+	bg->y = reply.y;
+	bg->detail = reply.detail;
+	bg->capped = reply.capped;
+	return bg;
+#else
+	return load_background_image(file, crop, targets, n_targets);
+#endif // HAVE_MEMFD
+}
+
+#if !HAVE_MEMFD
+int decode_helper_main(void) {
+	// Never started without memfds
+	return EXIT_FAILURE;
+}
+#endif
@@ -0,0 +1,83 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "decode-helper.h"
+#include "decode-thread.h"
+#include "log.h"
+#include "trace.h"
+
+struct decode_thread {
+	pthread_t thread;
+	const struct image_file *file;
+	const struct image_crop *crop;
+	struct background_target *targets;
+	size_t n_targets;
+	bool isolated;
+	struct event_source *done;
+
+	struct background_image *result;
+	atomic_bool finished;
+};
+
+static void *run_decode(void *data) {
+	struct decode_thread *thread = data;
+	swaybg_trace_begin("decode_thread");
+	if (thread->isolated) {
+		thread->result = load_background_image_isolated(thread->file,
+			thread->crop, thread->targets, thread->n_targets);
+	} else {
+		thread->result = load_background_image(thread->file,
+			thread->crop, thread->targets, thread->n_targets);
+	}
+	swaybg_trace_end("decode_thread");
+	atomic_store(&thread->finished, true);
+	event_source_notify(thread->done);
+	return NULL;
+}
+
+struct decode_thread *decode_thread_start(const struct image_file *file,
+		const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets,
+		bool isolated, struct event_source *done) {
+	struct decode_thread *thread = calloc(1, sizeof(struct decode_thread));
+	if (!thread) {
+		swaybg_log(LOG_ERROR, "Failed to allocate decode thread");
+		return NULL;
+	}
+	thread->targets = calloc(n_targets ? n_targets : 1, sizeof(*targets));
+	if (!thread->targets) {
+		swaybg_log(LOG_ERROR, "Failed to allocate decode targets");
+		free(thread);
+		return NULL;
+	}
+	memcpy(thread->targets, targets, n_targets * sizeof(*targets));
+	thread->n_targets = n_targets;
+	thread->file = file;
+	thread->crop = crop;
+	thread->isolated = isolated;
+	thread->done = done;
+	atomic_init(&thread->finished, false);
+
+	int ret = pthread_create(&thread->thread, NULL, run_decode, thread);
+	if (ret != 0) {
+		swaybg_log(LOG_ERROR, "Failed to start decode thread: %s",
+			strerror(ret));
+		free(thread->targets);
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+bool decode_thread_finished(struct decode_thread *thread) {
+	return atomic_load(&thread->finished);
+}
+
+struct background_image *decode_thread_join(struct decode_thread *thread) {
+	pthread_join(thread->thread, NULL);
+	struct background_image *result = thread->result;
+	free(thread->targets);
+	free(thread);
+	return result;
+}
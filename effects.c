@@ -0,0 +1,348 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "effects.h"
+#include "log.h"
+
+#define BLUR_PASSES 3
+#define MAX_THREADS 16
+#define BLUR_TILE_WIDTH 64
+// Below this many pixels per thread, spawning it costs more than it saves
+#define MIN_PIXELS_PER_THREAD (256 * 1024)
+
+// The four 8-bit channels of a pixel, and the same widened so that a box
+// sum fits in each lane. Normalizing goes through float because that
+// multiply exists on every SIMD baseline, unlike a 32-bit integer one.
+typedef uint8_t pixel __attribute__((vector_size(4)));
+typedef int32_t channels __attribute__((vector_size(16)));
+typedef float channels_f __attribute__((vector_size(16)));
+
+struct blur_job {
+	uint32_t *data;
+	int width, height, stride;
+	int radius[BLUR_PASSES];
+	int start, end; // band of rows or columns to blur
+	bool failed;
+};
+
+bool parse_background_effects(const char *str,
+		struct background_effects *effects) {
+	struct background_effects result = {0};
+	char *copy = strdup(str);
+	if (!copy) {
+		return false;
+	}
+
+	bool ok = true;
+	char *save = NULL;
+	for (char *effect = strtok_r(copy, ",", &save); effect && ok;
+			effect = strtok_r(NULL, ",", &save)) {
+		char *arg = strchr(effect, ':');
+		char *end = NULL;
+		double value = 0;
+		if (arg) {
+			*arg++ = '\0';
+			value = strtod(arg, &end);
+		}
+		if (!arg || end == arg || *end != '\0') {
+			swaybg_log(LOG_ERROR, "Effect '%s' needs a numeric argument, "
+				"e.g. blur:8 or dim:0.3", effect);
+			ok = false;
+		} else if (strcmp(effect, "blur") == 0 && value >= 0) {
+			result.blur = value;
+		} else if (strcmp(effect, "dim") == 0 && value >= 0 && value <= 1) {
+			result.dim = value;
+		} else {
+			swaybg_log(LOG_ERROR, "Invalid effect: %s:%s", effect, arg);
+			ok = false;
+		}
+	}
+	free(copy);
+
+	if (ok) {
+		*effects = result;
+	}
+	return ok;
+}
+
+bool background_effects_enabled(const struct background_effects *effects) {
+	return effects->blur > 0 || effects->dim > 0;
+}
+
+static inline channels unpack(uint32_t p) {
+	pixel px;
+	memcpy(&px, &p, sizeof(px));
+	return __builtin_convertvector(px, channels);
+}
+
+static inline uint32_t pack(channels c) {
+	pixel px = __builtin_convertvector(c, pixel);
+	uint32_t p;
+	memcpy(&p, &px, sizeof(p));
+	return p;
+}
+
+// Divide a box sum by the box size, rounding to nearest
+static inline channels normalize(channels sum, float inv) {
+	return __builtin_convertvector(
+		__builtin_convertvector(sum, channels_f) * inv + 0.5f, channels);
+}
+
+static inline uint32_t *get_row(const struct blur_job *job, int y) {
+	return (uint32_t *)((uint8_t *)job->data + (size_t)y * job->stride);
+}
+
+/*
+ * Pick the box widths whose repeated application best approximates a
+ * Gaussian with standard deviation `sigma`.
+ */
+static void gaussian_boxes(double sigma, int radius[static BLUR_PASSES]) {
+	int n = BLUR_PASSES;
+	double ideal = sqrt(12 * sigma * sigma / n + 1);
+	int lower = floor(ideal);
+	if (lower % 2 == 0) {
+		--lower;
+	}
+	int upper = lower + 2;
+	int m = round((12 * sigma * sigma - n * lower * lower - 4 * n * lower -
+		3 * n) / (-4.0 * lower - 4));
+	for (int i = 0; i < n; ++i) {
+		radius[i] = ((i < m ? lower : upper) - 1) / 2;
+	}
+}
+
+// One box pass along a line, clamping at the edges. O(1) per pixel.
+static void box_blur_line(channels *dst, const channels *src, int n, int r) {
+	float inv = 1.0f / (2 * r + 1);
+	channels sum = src[0] * (r + 1);
+	for (int i = 1; i <= r; ++i) {
+		sum += src[i < n ? i : n - 1];
+	}
+	for (int x = 0; x < n; ++x) {
+		dst[x] = normalize(sum, inv);
+		int add = x + r + 1, sub = x - r;
+		sum += src[add < n ? add : n - 1] - src[sub > 0 ? sub : 0];
+	}
+}
+
+static void blur_rows(struct blur_job *job) {
+	channels *a = malloc(job->width * sizeof(channels));
+	channels *b = malloc(job->width * sizeof(channels));
+	if (!a || !b) {
+		job->failed = true;
+		goto out;
+	}
+
+	for (int y = job->start; y < job->end; ++y) {
+		uint32_t *row = get_row(job, y);
+		for (int x = 0; x < job->width; ++x) {
+			a[x] = unpack(row[x]);
+		}
+		for (int p = 0; p < BLUR_PASSES; ++p) {
+			box_blur_line(b, a, job->width, job->radius[p]);
+			channels *tmp = a;
+			a = b;
+			b = tmp;
+		}
+		for (int x = 0; x < job->width; ++x) {
+			row[x] = pack(a[x]);
+		}
+	}
+
+out:
+	free(a);
+	free(b);
+}
+
+/*
+ * Box passes down `width` columns from `start`. Walking rows keeps memory
+ * access contiguous, and a ring of the last radius + 1 source rows allows
+ * blurring in place. Channels are summed as flat bytes so that with a
+ * constant width the loops vectorize.
+ */
+static inline void blur_column_tile(const struct blur_job *job, int start,
+		int width, int32_t *sums, uint8_t *ring) {
+	size_t len = (size_t)width * 4;
+	int h = job->height;
+	for (int p = 0; p < BLUR_PASSES; ++p) {
+		int r = job->radius[p];
+		float inv = 1.0f / (2 * r + 1);
+
+		const uint8_t *first = (uint8_t *)(get_row(job, 0) + start);
+		for (size_t i = 0; i < len; ++i) {
+			sums[i] = first[i] * (r + 1);
+		}
+		for (int j = 1; j <= r; ++j) {
+			const uint8_t *row =
+				(uint8_t *)(get_row(job, j < h ? j : h - 1) + start);
+			for (size_t i = 0; i < len; ++i) {
+				sums[i] += row[i];
+			}
+		}
+
+		for (int y = 0; y < h; ++y) {
+			uint8_t *row = (uint8_t *)(get_row(job, y) + start);
+			memcpy(ring + (y % (r + 1)) * len, row, len);
+			for (size_t i = 0; i < len; ++i) {
+				row[i] = (int32_t)(sums[i] * inv + 0.5f);
+			}
+			if (y + 1 == h) {
+				break;
+			}
+
+			int add_y = y + r + 1 < h ? y + r + 1 : h - 1;
+			int sub_y = y - r > 0 ? y - r : 0;
+			const uint8_t *add = (uint8_t *)(get_row(job, add_y) + start);
+			const uint8_t *sub = ring + (sub_y % (r + 1)) * len;
+			for (size_t i = 0; i < len; ++i) {
+				sums[i] += add[i] - sub[i];
+			}
+		}
+	}
+}
+
+/*
+ * Vertical passes over a band of columns, split into tiles narrow enough
+ * that the rows a pass is working on stay in cache across all passes.
+ */
+static void blur_columns(struct blur_job *job) {
+	int max_radius = 0;
+	for (int p = 0; p < BLUR_PASSES; ++p) {
+		if (job->radius[p] > max_radius) {
+			max_radius = job->radius[p];
+		}
+	}
+
+	int32_t *sums = malloc(BLUR_TILE_WIDTH * 4 * sizeof(int32_t));
+	uint8_t *ring = malloc((size_t)(max_radius + 1) * BLUR_TILE_WIDTH * 4);
+	if (!sums || !ring) {
+		job->failed = true;
+		goto out;
+	}
+
+	int x = job->start;
+	for (; x + BLUR_TILE_WIDTH <= job->end; x += BLUR_TILE_WIDTH) {
+		blur_column_tile(job, x, BLUR_TILE_WIDTH, sums, ring);
+	}
+	if (x < job->end) {
+		blur_column_tile(job, x, job->end - x, sums, ring);
+	}
+
+out:
+	free(sums);
+	free(ring);
+}
+
+static void *run_blur_rows(void *data) {
+	blur_rows(data);
+	return NULL;
+}
+
+static void *run_blur_columns(void *data) {
+	blur_columns(data);
+	return NULL;
+}
+
+/*
+ * Split `extent` rows or columns into bands and run `fn` on each band, in
+ * parallel where it is worth it. Returns false if any band failed.
+ */
+static bool run_banded(const struct blur_job *base, int extent,
+		void *(*fn)(void *)) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long pixels = (long)base->width * base->height;
+	int n = pixels / MIN_PIXELS_PER_THREAD;
+	if (n > cpus) {
+		n = cpus;
+	}
+	if (n > MAX_THREADS) {
+		n = MAX_THREADS;
+	}
+	if (n > extent) {
+		n = extent;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+
+	struct blur_job jobs[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	bool started[MAX_THREADS] = {0};
+	for (int i = 0; i < n; ++i) {
+		jobs[i] = *base;
+		jobs[i].start = (long)extent * i / n;
+		jobs[i].end = (long)extent * (i + 1) / n;
+		// The calling thread takes the first band itself
+		if (i > 0) {
+			started[i] = pthread_create(&threads[i], NULL, fn, &jobs[i]) == 0;
+		}
+	}
+	fn(&jobs[0]);
+
+	bool ok = !jobs[0].failed;
+	for (int i = 1; i < n; ++i) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		} else {
+			fn(&jobs[i]);
+		}
+		ok = ok && !jobs[i].failed;
+	}
+	return ok;
+}
+
+static void blur(uint32_t *data, int width, int height, int stride,
+		double sigma) {
+	struct blur_job job = {
+		.data = data,
+		.width = width,
+		.height = height,
+		.stride = stride,
+	};
+	gaussian_boxes(sigma, job.radius);
+	if (job.radius[BLUR_PASSES - 1] == 0) {
+		return;
+	}
+
+	// Box blurs are separable and commute, so all horizontal passes can run
+	// on row bands before all vertical passes run on column bands
+	if (!run_banded(&job, height, run_blur_rows) ||
+			!run_banded(&job, width, run_blur_columns)) {
+		swaybg_log(LOG_ERROR, "Failed to allocate blur buffers");
+	}
+}
+
+static void dim(uint32_t *data, int width, int height, int stride,
+		double amount) {
+	uint32_t f = lround((1 - amount) * 256);
+	for (int y = 0; y < height; ++y) {
+		uint32_t *row = (uint32_t *)((uint8_t *)data + (size_t)y * stride);
+		for (int x = 0; x < width; ++x) {
+			// Scale two channels per multiply
+			uint32_t p = row[x];
+			row[x] = (((p & 0xFF00FF) * f >> 8) & 0xFF00FF) |
+				(((p >> 8 & 0xFF00FF) * f) & 0xFF00FF00);
+		}
+	}
+}
+
+void apply_background_effects(const struct background_effects *effects,
+		uint32_t *data, int width, int height, int stride, double scale) {
+	if (effects->blur > 0) {
+		blur(data, width, height, stride, effects->blur * scale);
+	}
+	if (effects->dim > 0) {
+		dim(data, width, height, stride, effects->dim);
+	}
+}
+
+uint32_t dim_color_u32(const struct background_effects *effects,
+		uint32_t color) {
+	uint32_t f = lround((1 - effects->dim) * 256);
+	uint32_t rgb = color >> 8;
+	rgb = (((rgb & 0xFF00FF) * f >> 8) & 0xFF00FF) |
+		(((rgb >> 8 & 0xFF) * f) & 0xFF00);
+	return rgb << 8 | (color & 0xFF);
+}
@@ -0,0 +1,255 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "event-loop.h"
+#include "log.h"
+
+#define MAX_EVENTS 16
+
+enum event_source_type {
+	EVENT_SOURCE_FD,
+	EVENT_SOURCE_TIMER,
+	EVENT_SOURCE_SIGNAL,
+	EVENT_SOURCE_EVENT,
+};
+
+struct event_source {
+	struct event_loop *loop;
+	enum event_source_type type;
+	int fd;
+	int signal;
+	event_handler_t handler;
+	void *data;
+	bool removed;
+	struct wl_list link; // event_loop::sources or event_loop::removed
+};
+
+struct event_loop {
+	int epoll_fd;
+	struct wl_list sources;
+	// Sources removed since the last poll, freed once no pending epoll event
+	// can refer to them anymore
+	struct wl_list removed;
+};
+
+struct event_loop *event_loop_create(void) {
+	struct event_loop *loop = calloc(1, sizeof(*loop));
+	if (!loop) {
+		return NULL;
+	}
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "epoll_create1 failed");
+		free(loop);
+		return NULL;
+	}
+	wl_list_init(&loop->sources);
+	wl_list_init(&loop->removed);
+	return loop;
+}
+
+static void free_removed(struct event_loop *loop) {
+	struct event_source *source, *tmp;
+	wl_list_for_each_safe(source, tmp, &loop->removed, link) {
+		wl_list_remove(&source->link);
+		free(source);
+	}
+}
+
+void event_loop_destroy(struct event_loop *loop) {
+	if (!loop) {
+		return;
+	}
+	struct event_source *source, *tmp;
+	wl_list_for_each_safe(source, tmp, &loop->sources, link) {
+		event_source_remove(source);
+	}
+	free_removed(loop);
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+static struct event_source *add_source(struct event_loop *loop,
+		enum event_source_type type, int fd, uint32_t events,
+		event_handler_t handler, void *data) {
+	struct event_source *source = calloc(1, sizeof(*source));
+	if (!source) {
+		swaybg_log(LOG_ERROR, "Failed to allocate event source");
+		return NULL;
+	}
+	source->loop = loop;
+	source->type = type;
+	source->fd = fd;
+	source->handler = handler;
+	source->data = data;
+
+	struct epoll_event ev = { .events = events, .data.ptr = source };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to watch fd %d", fd);
+		free(source);
+		return NULL;
+	}
+	wl_list_insert(&loop->sources, &source->link);
+	return source;
+}
+
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd,
+		uint32_t events, event_handler_t handler, void *data) {
+	return add_source(loop, EVENT_SOURCE_FD, fd, events, handler, data);
+}
+
+bool event_source_update_fd(struct event_source *source, uint32_t events) {
+	struct epoll_event ev = { .events = events, .data.ptr = source };
+	if (epoll_ctl(source->loop->epoll_fd, EPOLL_CTL_MOD, source->fd,
+			&ev) != 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to update fd %d", source->fd);
+		return false;
+	}
+	return true;
+}
+
+struct event_source *event_loop_add_timer(struct event_loop *loop,
+		event_handler_t handler, void *data) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "timerfd_create failed");
+		return NULL;
+	}
+	struct event_source *source = add_source(loop, EVENT_SOURCE_TIMER, fd,
+		EPOLLIN, handler, data);
+	if (!source) {
+		close(fd);
+	}
+	return source;
+}
+
+bool event_source_arm_timer(struct event_source *source, uint32_t ms) {
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = ms / 1000,
+			.tv_nsec = (long)(ms % 1000) * 1000000,
+		},
+	};
+	if (timerfd_settime(source->fd, 0, &its, NULL) != 0) {
+		swaybg_log_errno(LOG_ERROR, "timerfd_settime failed");
+		return false;
+	}
+	return true;
+}
+
+struct event_source *event_loop_add_signal(struct event_loop *loop,
+		int signal, event_handler_t handler, void *data) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, signal);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to block signal %d", signal);
+		return NULL;
+	}
+	int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "signalfd failed");
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		return NULL;
+	}
+	struct event_source *source = add_source(loop, EVENT_SOURCE_SIGNAL, fd,
+		EPOLLIN, handler, data);
+	if (!source) {
+		close(fd);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		return NULL;
+	}
+	source->signal = signal;
+	return source;
+}
+
+struct event_source *event_loop_add_event(struct event_loop *loop,
+		event_handler_t handler, void *data) {
+	int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "eventfd failed");
+		return NULL;
+	}
+	struct event_source *source = add_source(loop, EVENT_SOURCE_EVENT, fd,
+		EPOLLIN, handler, data);
+	if (!source) {
+		close(fd);
+	}
+	return source;
+}
+
+void event_source_notify(struct event_source *source) {
+	uint64_t one = 1;
+	// Only fails if the counter would overflow, when it is already pending
+	write(source->fd, &one, sizeof(one));
+}
+
+void event_source_remove(struct event_source *source) {
+	if (!source || source->removed) {
+		return;
+	}
+	epoll_ctl(source->loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	if (source->type != EVENT_SOURCE_FD) {
+		close(source->fd);
+	}
+	if (source->type == EVENT_SOURCE_SIGNAL) {
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, source->signal);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	}
+	source->removed = true;
+	wl_list_remove(&source->link);
+	wl_list_insert(&source->loop->removed, &source->link);
+}
+
+static void dispatch_source(struct event_source *source, uint32_t events) {
+	// Consume the readiness so that level-triggered epoll does not spin
+	switch (source->type) {
+	case EVENT_SOURCE_FD:
+		break;
+	case EVENT_SOURCE_TIMER:
+	case EVENT_SOURCE_EVENT: {
+		uint64_t count;
+		if (read(source->fd, &count, sizeof(count)) != sizeof(count)) {
+			return;
+		}
+		break;
+	}
+	case EVENT_SOURCE_SIGNAL: {
+		struct signalfd_siginfo info;
+		if (read(source->fd, &info, sizeof(info)) != sizeof(info)) {
+			return;
+		}
+		break;
+	}
+	}
+	source->handler(events, source->data);
+}
+
+int event_loop_poll(struct event_loop *loop, int timeout) {
+	struct epoll_event events[MAX_EVENTS];
+	int n;
+	do {
+		n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		swaybg_log_errno(LOG_ERROR, "epoll_wait failed");
+		return -1;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		struct event_source *source = events[i].data.ptr;
+		if (!source->removed) {
+			dispatch_source(source, events[i].events);
+		}
+	}
+	free_removed(loop);
+	return n;
+}
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hash-table.h"
+
+#define MIN_SIZE 16
+
+// FNV-1a
+static uint32_t hash_string(const char *str) {
+	uint32_t hash = 2166136261u;
+	for (; *str; ++str) {
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+	}
+	return hash;
+}
+
+// The slot holding `key`, or the free slot where it would go
+static struct hash_entry *find_slot(const struct hash_table *table,
+		const char *key, uint32_t hash) {
+	size_t mask = table->size - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct hash_entry *entry = &table->entries[i];
+		if (!entry->key || (entry->hash == hash &&
+				strcmp(entry->key, key) == 0)) {
+			return entry;
+		}
+	}
+}
+
+static bool resize(struct hash_table *table, size_t size) {
+	struct hash_entry *entries = calloc(size, sizeof(*entries));
+	if (!entries) {
+		return false;
+	}
+	struct hash_table old = *table;
+	table->entries = entries;
+	table->size = size;
+	for (size_t i = 0; i < old.size; ++i) {
+		if (old.entries[i].key) {
+			*find_slot(table, old.entries[i].key, old.entries[i].hash) =
+				old.entries[i];
+		}
+	}
+	free(old.entries);
+	return true;
+}
+
+// The entry for `key`, added with a NULL value if missing
+static struct hash_entry *insert(struct hash_table *table, const char *key) {
+	// Kept at most three quarters full, so that probes stay short
+	if ((table->count + 1) * 4 > table->size * 3 &&
+			!resize(table, table->size ? table->size * 2 : MIN_SIZE)) {
+		return NULL;
+	}
+	uint32_t hash = hash_string(key);
+	struct hash_entry *entry = find_slot(table, key, hash);
+	if (!entry->key) {
+		char *copy = strdup(key);
+		if (!copy) {
+			return NULL;
+		}
+		*entry = (struct hash_entry){ .key = copy, .hash = hash };
+		++table->count;
+	}
+	return entry;
+}
+
+void hash_table_finish(struct hash_table *table) {
+	for (size_t i = 0; i < table->size; ++i) {
+		free(table->entries[i].key);
+	}
+	free(table->entries);
+	*table = (struct hash_table){0};
+}
+
+void *hash_table_get(const struct hash_table *table, const char *key) {
+	if (!table->count) {
+		return NULL;
+	}
+	struct hash_entry *entry = find_slot(table, key, hash_string(key));
+	return entry->value;
+}
+
+bool hash_table_set(struct hash_table *table, const char *key, void *value) {
+	struct hash_entry *entry = insert(table, key);
+	if (!entry) {
+		return false;
+	}
+	entry->value = value;
+	return true;
+}
+
+void hash_table_remove(struct hash_table *table, const char *key) {
+	if (!table->count) {
+		return;
+	}
+	struct hash_entry *hole = find_slot(table, key, hash_string(key));
+	if (!hole->key) {
+		return;
+	}
+	free(hole->key);
+	--table->count;
+
+	// Move back the entries after the hole that could not take its slot
+	// when inserted, so no probe stops short of them
+	size_t mask = table->size - 1;
+	size_t i = hole - table->entries;
+	for (size_t j = (i + 1) & mask; table->entries[j].key; j = (j + 1) & mask) {
+		size_t home = table->entries[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->entries[i] = table->entries[j];
+			i = j;
+		}
+	}
+	table->entries[i] = (struct hash_entry){0};
+}
+
+const char *hash_table_intern(struct hash_table *table, const char *key) {
+	struct hash_entry *entry = insert(table, key);
+	return entry ? entry->key : NULL;
+}
@@ -0,0 +1,410 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cairo_util.h"
+#include "image-loader.h"
+#include "log.h"
+
+// Keeps the per-channel sums of a factor x factor box within 32 bits
+#define MAX_REDUCTION 4096
+// Destination pixels kept around what the targets show, so that filtering
+// at the edges of an output still samples the image
+#define REGION_MARGIN 4
+// The largest image surface cairo creates
+#define MAX_SURFACE_SIZE 32767
+
+/*
+ * Return the cropped image in upright pixels of a width x height decode,
+ * which is stored in the sink's orientation.
+ */
+static struct image_box get_upright_crop(const struct image_sink *sink,
+		int width, int height) {
+	int file_width = sink->file_width ? sink->file_width : width;
+	int file_height = sink->file_height ? sink->file_height : height;
+	if (sink->orientation & WL_OUTPUT_TRANSFORM_90) {
+		int tmp = width;
+		width = height;
+		height = tmp;
+		tmp = file_width;
+		file_width = file_height;
+		file_height = tmp;
+	}
+
+	struct image_box box = { 0, 0, width, height };
+	const struct image_crop *crop = sink->crop;
+	if (!crop) {
+		return box;
+	}
+	double scale_x = (double)width / file_width;
+	double scale_y = (double)height / file_height;
+	double x0 = fmax(crop->x * scale_x, 0);
+	double y0 = fmax(crop->y * scale_y, 0);
+	double x1 = fmin((crop->x + crop->width) * scale_x, width);
+	double y1 = fmin((crop->y + crop->height) * scale_y, height);
+	if (x0 < x1 && y0 < y1) {
+		box = (struct image_box){ x0, y0, x1 - x0, y1 - y0 };
+	}
+	return box;
+}
+
+// Map a box of the upright image to the width x height stored pixels
+static struct image_box box_to_stored(const struct image_sink *sink,
+		int width, int height, struct image_box box) {
+	cairo_matrix_t matrix;
+	cairo_matrix_init_transform(&matrix, sink->orientation, width, height);
+	cairo_matrix_invert(&matrix);
+	double x0 = box.x, y0 = box.y;
+	double x1 = box.x + box.width, y1 = box.y + box.height;
+	cairo_matrix_transform_point(&matrix, &x0, &y0);
+	cairo_matrix_transform_point(&matrix, &x1, &y1);
+	return (struct image_box){
+		fmin(x0, x1), fmin(y0, y1), fabs(x1 - x0), fabs(y1 - y0),
+	};
+}
+
+/*
+ * Return the part of the upright, cropped image that any target shows. Fill
+ * cuts off two opposite edges and center what exceeds the target, the other
+ * modes show everything.
+ */
+static struct image_box get_visible_box(const struct image_sink *sink,
+		struct image_box crop) {
+	if (sink->n_targets == 0) {
+		return crop;
+	}
+	double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+	for (size_t i = 0; i < sink->n_targets; ++i) {
+		const struct background_target *target = &sink->targets[i];
+		struct image_box box = crop;
+		if (target->width <= 0 || target->height <= 0) {
+			return crop;
+		}
+		double target_ratio = (double)target->width / target->height;
+		switch (target->mode) {
+		case BACKGROUND_MODE_FILL:
+		case BACKGROUND_MODE_SPAN:
+			if (target_ratio > crop.width / crop.height) {
+				box.height = crop.width / target_ratio;
+				box.y += (crop.height - box.height) / 2;
+			} else {
+				box.width = crop.height * target_ratio;
+				box.x += (crop.width - box.width) / 2;
+			}
+			break;
+		case BACKGROUND_MODE_CENTER:
+			if (target->width < crop.width) {
+				box.width = target->width;
+				box.x += (crop.width - box.width) / 2;
+			}
+			if (target->height < crop.height) {
+				box.height = target->height;
+				box.y += (crop.height - box.height) / 2;
+			}
+			break;
+		case BACKGROUND_MODE_TILE:
+			// Tiles start at the image's corner, so an image larger than the
+			// target never repeats and only that corner shows
+			box.width = fmin(crop.width, target->width);
+			box.height = fmin(crop.height, target->height);
+			break;
+		default:
+			return crop;
+		}
+		x0 = fmin(x0, box.x);
+		y0 = fmin(y0, box.y);
+		x1 = fmax(x1, box.x + box.width);
+		y1 = fmax(y1, box.y + box.height);
+	}
+	return (struct image_box){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+double image_sink_min_scale(const struct image_sink *sink,
+		int width, int height) {
+	if (sink->n_targets == 0) {
+		return 1;
+	}
+	// Targets are upright and show the cropped image
+	struct image_box crop = get_upright_crop(sink, width, height);
+	double scale = 0;
+	for (size_t i = 0; i < sink->n_targets; ++i) {
+		const struct background_target *target = &sink->targets[i];
+		double s = background_image_min_scale(target->mode,
+			lround(crop.width), lround(crop.height),
+			target->width, target->height);
+		if (s > scale) {
+			scale = s;
+		}
+	}
+	return scale < 1 ? scale : 1;
+}
+
+// Set the region of the decoded pixels to keep
+static void set_region(struct image_sink *sink, int width, int height) {
+	struct image_box crop = get_upright_crop(sink, width, height);
+	struct image_box visible = get_visible_box(sink, crop);
+	double margin = REGION_MARGIN * sink->factor;
+	double x0 = fmax(visible.x - margin, crop.x);
+	double y0 = fmax(visible.y - margin, crop.y);
+	double x1 = fmin(visible.x + visible.width + margin, crop.x + crop.width);
+	double y1 = fmin(visible.y + visible.height + margin,
+		crop.y + crop.height);
+	struct image_box region = box_to_stored(sink, width, height,
+		(struct image_box){ x0, y0, x1 - x0, y1 - y0 });
+
+	sink->crop_box = box_to_stored(sink, width, height, crop);
+	sink->region_x = fmax(floor(region.x), 0);
+	sink->region_y = fmax(floor(region.y), 0);
+	sink->region_width = fmin(ceil(region.x + region.width), width) -
+		sink->region_x;
+	sink->region_height = fmin(ceil(region.y + region.height), height) -
+		sink->region_y;
+}
+
+// Keep the region for a reduction by `factor`
+static void set_factor(struct image_sink *sink, int width, int height,
+		int factor) {
+	sink->factor = factor;
+	set_region(sink, width, height);
+	sink->width = (sink->region_width + factor - 1) / factor;
+	sink->height = (sink->region_height + factor - 1) / factor;
+}
+
+bool image_sink_begin(struct image_sink *sink, int width, int height,
+		bool alpha) {
+	double scale = image_sink_min_scale(sink, width, height);
+	int factor = scale > 0 ? (int)(1 / scale) : MAX_REDUCTION;
+	if (factor < 1) {
+		factor = 1;
+	} else if (factor > MAX_REDUCTION) {
+		factor = MAX_REDUCTION;
+	}
+
+	sink->src_width = width;
+	sink->src_height = height;
+	set_factor(sink, width, height, factor);
+	while ((sink->width > MAX_SURFACE_SIZE ||
+			sink->height > MAX_SURFACE_SIZE) && factor < MAX_REDUCTION) {
+		// Losing detail beats failing to show anything
+		int size = sink->region_width > sink->region_height ?
+			sink->region_width : sink->region_height;
+		int needed = (size + MAX_SURFACE_SIZE - 1) / MAX_SURFACE_SIZE;
+		factor = needed > factor ? needed : factor + 1;
+		set_factor(sink, width, height, factor);
+		sink->capped = true;
+	}
+	if (sink->capped) {
+		swaybg_log(LOG_INFO, "Image region is too large for a surface, "
+			"reducing it by %d", factor);
+	}
+	sink->row_x = 0;
+	sink->src_row = 0;
+	if (sink->region_width < width || sink->region_height < height) {
+		swaybg_log(LOG_DEBUG, "Keeping %dx%d region at %d,%d of %dx%d image",
+			sink->region_width, sink->region_height,
+			sink->region_x, sink->region_y, width, height);
+	}
+
+	if (factor > 1 || sink->interlaced) {
+		// Pixels that arrive out of order are summed over the whole
+		// destination rather than a row of it
+		size_t accum_rows = sink->interlaced ? sink->height : 1;
+		sink->line = malloc(sink->region_width * sizeof(uint32_t));
+		sink->accum = factor > 1 ?
+			calloc((size_t)sink->width * accum_rows * 4, sizeof(uint32_t)) :
+			NULL;
+		if (!sink->line || (factor > 1 && !sink->accum)) {
+			swaybg_log(LOG_ERROR, "Failed to allocate decode rows");
+			image_sink_abort(sink);
+			return false;
+		}
+	}
+	if (factor > 1) {
+		swaybg_log(LOG_DEBUG, "Reducing %dx%d pixels by %d to %dx%d",
+			sink->region_width, sink->region_height, factor,
+			sink->width, sink->height);
+	}
+
+	sink->surface = cairo_image_surface_create(
+		alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+		sink->width, sink->height);
+	if (cairo_surface_status(sink->surface) != CAIRO_STATUS_SUCCESS) {
+		swaybg_log(LOG_ERROR, "Failed to create %dx%d image surface: %s",
+			sink->width, sink->height,
+			cairo_status_to_string(cairo_surface_status(sink->surface)));
+		image_sink_abort(sink);
+		return false;
+	}
+	cairo_surface_flush(sink->surface);
+	return true;
+}
+
+// Same rounding as cairo's and gdk_cairo_image_surface_create_from_pixbuf()
+static inline uint32_t premul(uint32_t c, uint32_t a) {
+	uint32_t z = c * a + 0x80;
+	return (z + (z >> 8)) >> 8;
+}
+
+static void convert_row(uint32_t *dst, const uint8_t *src,
+		enum image_row_format format, int width) {
+	switch (format) {
+	case IMAGE_ROW_RGB:
+		for (int x = 0; x < width; ++x, src += 3) {
+			dst[x] = 0xFF000000 | (uint32_t)src[0] << 16 |
+				(uint32_t)src[1] << 8 | src[2];
+		}
+		break;
+	case IMAGE_ROW_RGBA:
+		for (int x = 0; x < width; ++x, src += 4) {
+			uint32_t a = src[3];
+			dst[x] = a << 24 | premul(src[0], a) << 16 |
+				premul(src[1], a) << 8 | premul(src[2], a);
+		}
+		break;
+	case IMAGE_ROW_NATIVE:
+		memcpy(dst, src, width * sizeof(uint32_t));
+		break;
+	}
+}
+
+static size_t row_pixel_size(enum image_row_format format) {
+	return format == IMAGE_ROW_RGB ? 3 : 4;
+}
+
+// Write the averages of the sums of an output row's boxes, `rows` tall
+static void flush_accum(struct image_sink *sink, int y, int rows,
+		const uint32_t *accum) {
+	unsigned char *data = cairo_image_surface_get_data(sink->surface);
+	int stride = cairo_image_surface_get_stride(sink->surface);
+	uint32_t *dst = (uint32_t *)(data + (size_t)y * stride);
+
+	for (int x = 0; x < sink->width; ++x) {
+		int cols = sink->region_width - x * sink->factor;
+		if (cols > sink->factor) {
+			cols = sink->factor;
+		}
+		uint32_t n = cols * rows;
+		const uint32_t *sum = &accum[x * 4];
+		dst[x] = (sum[0] + n / 2) / n << 24 | (sum[1] + n / 2) / n << 16 |
+			(sum[2] + n / 2) / n << 8 | (sum[3] + n / 2) / n;
+	}
+}
+
+static inline void accumulate(uint32_t *sum, uint32_t p) {
+	sum[0] += p >> 24;
+	sum[1] += (p >> 16) & 0xFF;
+	sum[2] += (p >> 8) & 0xFF;
+	sum[3] += p & 0xFF;
+}
+
+void image_sink_skip_rows(struct image_sink *sink, int n) {
+	sink->src_row += n;
+}
+
+void image_sink_write_row(struct image_sink *sink, const uint8_t *row,
+		enum image_row_format format) {
+	if (!sink->surface) {
+		return;
+	}
+	int y = sink->src_row++ - sink->region_y;
+	if (y < 0 || y >= sink->region_height) {
+		return;
+	}
+	row += (size_t)(sink->region_x - sink->row_x) * row_pixel_size(format);
+
+	if (sink->factor == 1) {
+		unsigned char *data = cairo_image_surface_get_data(sink->surface);
+		int stride = cairo_image_surface_get_stride(sink->surface);
+		convert_row((uint32_t *)(data + (size_t)y * stride), row, format,
+			sink->region_width);
+		return;
+	}
+
+	convert_row(sink->line, row, format, sink->region_width);
+	for (int x = 0; x < sink->region_width; ++x) {
+		accumulate(&sink->accum[x / sink->factor * 4], sink->line[x]);
+	}
+
+	int rows = y % sink->factor + 1;
+	if (rows == sink->factor || y + 1 == sink->region_height) {
+		flush_accum(sink, y / sink->factor, rows, sink->accum);
+		memset(sink->accum, 0, sink->width * 4 * sizeof(uint32_t));
+	}
+}
+
+void image_sink_write_pixels(struct image_sink *sink, const uint8_t *row,
+		enum image_row_format format, int y, int x, int step, int n) {
+	if (!sink->surface) {
+		return;
+	}
+	y -= sink->region_y;
+	if (y < 0 || y >= sink->region_height) {
+		return;
+	}
+	// The pixels that fall within the region's columns
+	int first = 0;
+	if (x < sink->region_x) {
+		first = (sink->region_x - x + step - 1) / step;
+	}
+	int end = sink->region_x + sink->region_width - x;
+	int last = end > 0 ? (end + step - 1) / step : 0;
+	if (last > n) {
+		last = n;
+	}
+	if (first >= last) {
+		return;
+	}
+	n = last - first;
+	convert_row(sink->line, row + (size_t)first * row_pixel_size(format),
+		format, n);
+	x += first * step - sink->region_x;
+
+	if (sink->factor == 1) {
+		unsigned char *data = cairo_image_surface_get_data(sink->surface);
+		int stride = cairo_image_surface_get_stride(sink->surface);
+		uint32_t *dst = (uint32_t *)(data + (size_t)y * stride);
+		for (int i = 0; i < n; ++i, x += step) {
+			dst[x] = sink->line[i];
+		}
+		return;
+	}
+
+	uint32_t *sums = sink->accum +
+		(size_t)(y / sink->factor) * sink->width * 4;
+	for (int i = 0; i < n; ++i, x += step) {
+		accumulate(&sums[x / sink->factor * 4], sink->line[i]);
+	}
+}
+
+bool image_sink_done(const struct image_sink *sink) {
+	return sink->src_row >= sink->region_y + sink->region_height;
+}
+
+cairo_surface_t *image_sink_finish(struct image_sink *sink) {
+	if (sink->interlaced && sink->accum && sink->surface) {
+		for (int y = 0; y < sink->height; ++y) {
+			int rows = sink->region_height - y * sink->factor;
+			flush_accum(sink, y, rows < sink->factor ? rows : sink->factor,
+				sink->accum + (size_t)y * sink->width * 4);
+		}
+	}
+	free(sink->line);
+	free(sink->accum);
+	sink->line = sink->accum = NULL;
+
+	cairo_surface_t *surface = sink->surface;
+	sink->surface = NULL;
+	if (surface) {
+		cairo_surface_mark_dirty(surface);
+	}
+	return surface;
+}
+
+void image_sink_abort(struct image_sink *sink) {
+	// Nothing is left to flush
+	free(sink->accum);
+	sink->accum = NULL;
+	cairo_surface_t *surface = image_sink_finish(sink);
+	if (surface) {
+		cairo_surface_destroy(surface);
+	}
+}
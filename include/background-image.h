@@ -1,5 +1,8 @@
 #ifndef _SWAY_BACKGROUND_IMAGE_H
 #define _SWAY_BACKGROUND_IMAGE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "cairo_util.h"
 
 enum background_mode {
@@ -8,13 +11,93 @@ enum background_mode {
 	BACKGROUND_MODE_FIT,
 	BACKGROUND_MODE_CENTER,
 	BACKGROUND_MODE_TILE,
+	BACKGROUND_MODE_SPAN,
 	BACKGROUND_MODE_SOLID_COLOR,
 	BACKGROUND_MODE_INVALID,
 };
 
+// An output buffer a decoded image is going to be rendered on
+struct background_target {
+	enum background_mode mode;
+	int width, height;
+};
+
+// The contents of an image file, read into memory ahead of decoding
+struct image_file {
+	const char *path;
+	uint8_t *data;
+	size_t size;
+	bool mapped;
+};
+
+// A rectangle of the upright image, in pixels of the image file
+struct image_crop {
+	int x, y, width, height;
+};
+
+struct background_image {
+	cairo_surface_t *surface;
+	// Transform from the decoded pixels to the upright image, taken from its
+	// EXIF orientation instead of rotating a copy of the pixels
+	enum wl_output_transform orientation;
+	// Size of the (cropped) image before orientation in pixels of `surface`,
+	// and where `surface` lies in it. Only the part of the image that is
+	// shown may have been decoded.
+	double width, height;
+	double x, y;
+	// Decoded pixels per pixel of the file, less than 1 if decoding reduced
+	// the image
+	double detail;
+	// Whether decoding reduced the image further than needed, because a
+	// surface could not hold it at that size. Decoding again is no help.
+	bool capped;
+	// The next level of the mipmap pyramid, built when first sampled
+	struct background_image *reduced;
+	// A vector image has no surface of its own, but rasters of the part each
+	// target shows at the size it shows it, most recently used first
+	struct svg_image *svg;
+	struct background_image *rasters;
+	struct background_image *next;
+};
+
 enum background_mode parse_background_mode(const char *mode);
-cairo_surface_t *load_background_image(const char *path);
-void render_background_image(cairo_t *cairo, cairo_surface_t *image,
-		enum background_mode mode, int buffer_width, int buffer_height);
+// Parse a <width>x<height>+<x>+<y> crop geometry
+bool parse_image_crop(const char *str, struct image_crop *crop);
+enum wl_output_transform parse_exif_orientation(int orientation);
+double background_image_min_scale(enum background_mode mode,
+		int width, int height, int buffer_width, int buffer_height);
+/*
+ * Map `path` and ask the kernel to start reading it in, so the I/O overlaps
+ * with whatever happens before the image is decoded.
+ */
+bool image_file_open(struct image_file *file, const char *path);
+void image_file_close(struct image_file *file);
+/*
+ * Decode the image in `file`, cropped to `crop` unless NULL. Pixels none of
+ * the targets show are skipped where the format allows it.
+ */
+struct background_image *load_background_image(const struct image_file *file,
+		const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets);
+/*
+ * Whether the decoded image has all the detail and every pixel that
+ * rendering it on the targets needs, so that it need not be decoded again.
+ */
+bool background_image_fits(const struct background_image *image,
+		const struct background_target *targets, size_t n_targets);
+/*
+ * Render the image and the `bg_color` background around and behind it onto
+ * the image surface `cairo` targets, which does not need to be cleared. In
+ * span mode, the image fills a buffer_width x buffer_height area spanning
+ * several outputs, and the matrix selects this output's part of it.
+ *
+ * Downscaled images are sampled from the mipmap level closest in size, and
+ * vector images from a raster made for this buffer, with `filter`.
+ */
+void render_background_image(cairo_t *cairo,
+		struct background_image *image, enum background_mode mode,
+		uint32_t bg_color, int buffer_width, int buffer_height,
+		cairo_filter_t filter);
+void destroy_background_image(struct background_image *image);
 
 #endif
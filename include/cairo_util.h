@@ -1,23 +1,34 @@
 #ifndef _SWAY_CAIRO_UTIL_H
 #define _SWAY_CAIRO_UTIL_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <cairo.h>
 #include <wayland-client.h>
-#if HAVE_GDK_PIXBUF
-#include <gdk-pixbuf/gdk-pixbuf.h>
-#endif
 
 void cairo_set_source_u32(cairo_t *cairo, uint32_t color);
+// The premultiplied 32-bit pixel cairo would paint for a 0xRRGGBBAA color
+uint32_t cairo_pixel_from_u32(uint32_t color);
+void fill_pixels(uint32_t *data, size_t n, uint32_t pixel);
+/*
+ * Fill a rectangle of a flushed 32-bit image surface with `pixel`, without
+ * going through cairo. The caller marks the surface dirty.
+ */
+void cairo_image_surface_fill(cairo_surface_t *surface,
+		int x, int y, int width, int height, uint32_t pixel);
 cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel);
+void cairo_matrix_init_transform(cairo_matrix_t *matrix,
+		enum wl_output_transform transform, double width, double height);
 
 cairo_surface_t *cairo_image_surface_scale(cairo_surface_t *image,
 		int width, int height);
 
 #if HAVE_GDK_PIXBUF
 
-cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(
-		const GdkPixbuf *gdkbuf);
+// Convert the 8-bit RGB or non-premultiplied RGBA pixels of a GdkPixbuf
+cairo_surface_t *cairo_image_surface_create_from_pixbuf_data(
+		const uint8_t *pixels, int n_channels, int width, int height,
+		int stride);
 
 #endif // HAVE_GDK_PIXBUF
 
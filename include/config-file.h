@@ -0,0 +1,20 @@
+#ifndef _SWAYBG_CONFIG_FILE_H
+#define _SWAYBG_CONFIG_FILE_H
+#include <stdbool.h>
+
+/*
+ * Called for each `key = value` line, with the output of the `[output]`
+ * section it is in, or "*" before the first section. Returns false if the
+ * key or value is invalid.
+ */
+typedef bool (*config_file_handler_t)(const char *output, const char *key,
+		const char *value, void *data);
+
+/*
+ * Read the configuration at `path`. Invalid lines are logged and skipped;
+ * returns false only if the file cannot be read.
+ */
+bool config_file_load(const char *path, config_file_handler_t handler,
+		void *data);
+
+#endif
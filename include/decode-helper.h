@@ -0,0 +1,23 @@
+#ifndef _SWAYBG_DECODE_HELPER_H
+#define _SWAYBG_DECODE_HELPER_H
+#include <stddef.h>
+#include "background-image.h"
+
+// swaybg runs as the decode helper when this is its only argument
+#define DECODE_HELPER_ARG "--run-decode-helper"
+
+/*
+ * Like load_background_image(), but decode in a short-lived helper process,
+ * so that none of the memory decoding takes is ever allocated here. The
+ * file's bytes go to the helper, and the pixels come back, in sealed
+ * memfds; the returned image maps the pixels read-only. Decodes in this process
+ * if memfds are not supported.
+ */
+struct background_image *load_background_image_isolated(
+		const struct image_file *file, const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets);
+
+// The helper's main(), serving one request on its standard input
+int decode_helper_main(void);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _SWAYBG_DECODE_THREAD_H
+#define _SWAYBG_DECODE_THREAD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "background-image.h"
+#include "event-loop.h"
+
+struct decode_thread;
+
+/*
+ * Decode an image on a thread of its own, notifying `done` once finished.
+ * `file` and `crop` must stay valid until the thread is joined; the targets
+ * are copied. With `isolated` set, the thread decodes in a helper process.
+ */
+struct decode_thread *decode_thread_start(const struct image_file *file,
+		const struct image_crop *crop,
+		const struct background_target *targets, size_t n_targets,
+		bool isolated, struct event_source *done);
+bool decode_thread_finished(struct decode_thread *thread);
+// Wait for the decode to finish, free the thread and return its result
+struct background_image *decode_thread_join(struct decode_thread *thread);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _SWAYBG_EFFECTS_H
+#define _SWAYBG_EFFECTS_H
+#include <stdbool.h>
+#include <stdint.h>
+
+struct background_effects {
+	double blur; // Gaussian standard deviation in logical pixels, 0 for none
+	double dim;  // fraction to darken by, from 0 to 1
+};
+
+bool parse_background_effects(const char *str,
+		struct background_effects *effects);
+bool background_effects_enabled(const struct background_effects *effects);
+
+/*
+ * Apply effects in place to 32-bit XRGB pixels. `scale` is the number of
+ * buffer pixels per logical pixel.
+ */
+void apply_background_effects(const struct background_effects *effects,
+		uint32_t *data, int width, int height, int stride, double scale);
+
+// Dim a 0xRRGGBBAA color, for buffers that are never drawn into
+uint32_t dim_color_u32(const struct background_effects *effects,
+		uint32_t color);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _SWAYBG_EVENT_LOOP_H
+#define _SWAYBG_EVENT_LOOP_H
+#include <stdbool.h>
+#include <stdint.h>
+
+struct event_loop;
+struct event_source;
+
+/*
+ * Called with the epoll events that fired. Timer, signal and event sources
+ * have already consumed their fd's data by then; plain fd sources (e.g. an
+ * inotify descriptor) must read their own.
+ */
+typedef void (*event_handler_t)(uint32_t events, void *data);
+
+struct event_loop *event_loop_create(void);
+void event_loop_destroy(struct event_loop *loop);
+
+/*
+ * Wait up to `timeout` ms, or forever if negative, for sources to become
+ * ready and run their handlers. Returns the number of sources dispatched,
+ * or -1 on error.
+ */
+int event_loop_poll(struct event_loop *loop, int timeout);
+
+// Watch `fd` for `events` (EPOLLIN, EPOLLOUT, ...). The fd stays the caller's.
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd,
+		uint32_t events, event_handler_t handler, void *data);
+bool event_source_update_fd(struct event_source *source, uint32_t events);
+
+// A timerfd, disarmed until event_source_arm_timer() is called
+struct event_source *event_loop_add_timer(struct event_loop *loop,
+		event_handler_t handler, void *data);
+// Fire once after `ms` milliseconds, or disarm if 0
+bool event_source_arm_timer(struct event_source *source, uint32_t ms);
+
+/*
+ * A signalfd for `signal`. The signal is blocked so that it is only ever
+ * delivered here; do this before starting any thread.
+ */
+struct event_source *event_loop_add_signal(struct event_loop *loop,
+		int signal, event_handler_t handler, void *data);
+
+/*
+ * An eventfd, for other threads to wake the loop up with
+ * event_source_notify(). Notifications coalesce into a single dispatch.
+ */
+struct event_source *event_loop_add_event(struct event_loop *loop,
+		event_handler_t handler, void *data);
+void event_source_notify(struct event_source *source);
+
+// Stop watching and free a source; safe to call from any handler
+void event_source_remove(struct event_source *source);
+
+#endif
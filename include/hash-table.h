@@ -0,0 +1,37 @@
+#ifndef _SWAYBG_HASH_TABLE_H
+#define _SWAYBG_HASH_TABLE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct hash_entry {
+	char *key; // NULL if the slot is free
+	uint32_t hash;
+	void *value;
+};
+
+/*
+ * A map from strings to pointers, with open addressing. The table owns
+ * copies of its keys. Zero-initialized, it is empty and ready to use.
+ */
+struct hash_table {
+	struct hash_entry *entries;
+	size_t size; // 0, or a power of two
+	size_t count;
+};
+
+void hash_table_finish(struct hash_table *table);
+
+// The value stored for `key`, or NULL
+void *hash_table_get(const struct hash_table *table, const char *key);
+// Store `value` for `key`, replacing any. Returns false if out of memory.
+bool hash_table_set(struct hash_table *table, const char *key, void *value);
+void hash_table_remove(struct hash_table *table, const char *key);
+
+/*
+ * The table's copy of `key`, added if missing, so that equal strings become
+ * the same pointer for as long as the table lives. NULL if out of memory.
+ */
+const char *hash_table_intern(struct hash_table *table, const char *key);
+
+#endif
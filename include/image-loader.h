@@ -0,0 +1,122 @@
+#ifndef _SWAYBG_IMAGE_LOADER_H
+#define _SWAYBG_IMAGE_LOADER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <cairo.h>
+#include "background-image.h"
+
+enum image_row_format {
+	IMAGE_ROW_RGB,    // 8-bit R, G, B
+	IMAGE_ROW_RGBA,   // 8-bit R, G, B, A, not premultiplied
+	IMAGE_ROW_NATIVE, // cairo's native premultiplied 32-bit pixels
+};
+
+// A rectangle of decoded pixels
+struct image_box {
+	double x, y, width, height;
+};
+
+/*
+ * Receives decoded scanlines one at a time and writes them into the
+ * destination image surface, box-reducing them on the fly when every target
+ * the image is rendered on is small enough to allow it. Only the destination
+ * surface and a couple of rows are ever held in memory, or for interlaced
+ * images, per-channel sums for the whole destination.
+ *
+ * Only the region of the image some target shows is kept. Decoders that can
+ * skip the rest should decode just the region's rows and columns.
+ */
+struct image_sink {
+	const struct background_target *targets;
+	size_t n_targets;
+	const struct image_crop *crop; // NULL for the whole image
+	// Set by the decoder before image_sink_begin()
+	enum wl_output_transform orientation;
+	int file_width, file_height; // if the decoded size differs
+	bool interlaced; // pixels come through image_sink_write_pixels()
+
+	cairo_surface_t *surface;
+	int src_width, src_height;
+	// The cropped image, and the part of the decoded pixels that is kept
+	struct image_box crop_box;
+	int region_x, region_y, region_width, region_height;
+	int width, height;
+	int factor;
+	bool capped; // reduced beyond what the targets need, to fit a surface
+	// Set by decoders that scale the region to width x height themselves,
+	// rather than reduce it by factor with a partial last pixel
+	bool resampled;
+
+	int row_x; // column the rows written start at, set by the decoder
+	int src_row;
+	uint32_t *line;  // converted source row
+	uint32_t *accum; // per-channel sums of the pending output row
+};
+
+/*
+ * Returns the smallest scale a width x height image may be decoded at
+ * without losing detail on any of the sink's targets.
+ */
+double image_sink_min_scale(const struct image_sink *sink,
+		int width, int height);
+bool image_sink_begin(struct image_sink *sink, int width, int height,
+		bool alpha);
+// Account for `n` rows the decoder skipped without decoding them
+void image_sink_skip_rows(struct image_sink *sink, int n);
+void image_sink_write_row(struct image_sink *sink, const uint8_t *row,
+		enum image_row_format format);
+/*
+ * Write the `n` pixels of a partial source row `y`, which are at columns x,
+ * x + step, x + 2 * step and so on, in any order of rows.
+ */
+void image_sink_write_pixels(struct image_sink *sink, const uint8_t *row,
+		enum image_row_format format, int y, int x, int step, int n);
+// Whether every row of the region has been written
+bool image_sink_done(const struct image_sink *sink);
+cairo_surface_t *image_sink_finish(struct image_sink *sink);
+void image_sink_abort(struct image_sink *sink);
+
+/*
+ * Native decoders. These return NULL both on error and when the image uses a
+ * feature they do not handle, in which case the caller falls back to the
+ * next available loader.
+ */
+#if HAVE_LIBPNG
+cairo_surface_t *load_png_image(FILE *file, struct image_sink *sink);
+#endif
+#if HAVE_LIBJPEG
+cairo_surface_t *load_jpeg_image(FILE *file, struct image_sink *sink);
+#endif
+#if HAVE_LIBWEBP
+cairo_surface_t *load_webp_image(FILE *file, struct image_sink *sink);
+#endif
+
+#if HAVE_GDK_PIXBUF
+/*
+ * Decode any format gdk-pixbuf knows, loading the library on first use.
+ * Returns NULL if either fails.
+ */
+cairo_surface_t *load_pixbuf_image(const struct image_file *file,
+		enum wl_output_transform *orientation);
+#endif
+
+#if HAVE_LIBRSVG
+/*
+ * Parse an SVG document, cropped to `crop` unless NULL, and return the size
+ * of the cropped document in pixels. Returns NULL if it is not one.
+ */
+struct svg_image *load_svg_image(const struct image_file *file,
+		const struct image_crop *crop, double *width, double *height);
+/*
+ * Rasterize the document scaled to width x height pixels, keeping the
+ * surface_width x surface_height pixels from x, y on.
+ */
+cairo_surface_t *render_svg_image(struct svg_image *svg,
+		int surface_width, int surface_height,
+		double x, double y, double width, double height);
+void destroy_svg_image(struct svg_image *svg);
+#endif
+
+#endif
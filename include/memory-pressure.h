@@ -0,0 +1,22 @@
+#ifndef _SWAYBG_MEMORY_PRESSURE_H
+#define _SWAYBG_MEMORY_PRESSURE_H
+#include <stddef.h>
+#include "event-loop.h"
+
+struct memory_monitor;
+
+// Called with what reported the pressure
+typedef void (*memory_pressure_handler_t)(const char *reason, void *data);
+
+/*
+ * Watch the system's memory pressure stall information and the memory
+ * events of our cgroup, whichever are available. Returns NULL if neither is.
+ */
+struct memory_monitor *memory_monitor_create(struct event_loop *loop,
+		memory_pressure_handler_t handler, void *data);
+void memory_monitor_destroy(struct memory_monitor *monitor);
+
+// The resident set size of the process in bytes, or 0 if unknown
+size_t memory_resident_bytes(void);
+
+#endif
@@ -15,6 +15,13 @@ struct pool_buffer {
 
 bool create_buffer(struct pool_buffer *buffer, struct wl_shm *shm,
 		int32_t width, int32_t height, uint32_t format);
+
+/*
+ * Create `n` buffers sharing a single shm pool and mapping. Each one is
+ * still released on its own with destroy_buffer().
+ */
+bool create_buffers(struct pool_buffer *buffers, size_t n, struct wl_shm *shm,
+		int32_t width, int32_t height, uint32_t format);
 void destroy_buffer(struct pool_buffer *buffer);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef _SWAYBG_PRESENTATION_H
+#define _SWAYBG_PRESENTATION_H
+#include <time.h>
+#include <wayland-client.h>
+#include "presentation-time-client-protocol.h"
+
+// Latencies up to the moment frames were presented, in milliseconds
+struct latency_stats {
+	int count;
+	double min, max, total;
+};
+
+struct presentation_stats {
+	int presented, discarded;
+	double first; // from process start to the first frame, in ms
+	// Per frame, from the configure event it answers and from its image
+	// being ready
+	struct latency_stats configure, ready;
+};
+
+// What a committed frame was waiting for, in CLOCK_MONOTONIC time
+struct frame_times {
+	struct timespec configure; // zero unless the frame answers a configure
+	struct timespec ready;
+};
+
+// Mark the process start, which first frames are measured from
+void presentation_clock_start(void);
+void presentation_init(struct wp_presentation *presentation);
+/*
+ * Ask for feedback on the next commit of `surface`, for the output called
+ * `*name`. Latencies are logged as the frame is presented and added to
+ * `stats`. The request stays on `pending` until then.
+ */
+void presentation_request_feedback(struct wp_presentation *presentation,
+		struct wl_surface *surface, char *const *name,
+		const struct frame_times *times, struct presentation_stats *stats,
+		struct wl_list *pending);
+void presentation_cancel_feedback(struct wl_list *pending);
+void presentation_log_summary(const char *name,
+		const struct presentation_stats *stats);
+
+#endif
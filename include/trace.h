@@ -0,0 +1,37 @@
+#ifndef _SWAYBG_TRACE_H
+#define _SWAYBG_TRACE_H
+
+#include <stdbool.h>
+#include "log.h"
+
+extern bool _swaybg_trace_enabled;
+
+/*
+ * Start writing Chrome trace-event JSON to `path`. Until this succeeds, all
+ * of the tracing macros below reduce to a single branch.
+ */
+bool swaybg_trace_init(const char *path);
+
+void _swaybg_trace_span(char phase, const char *name);
+void _swaybg_trace_instant(const char *name, const char *fmt, ...)
+	_ATTRIB_PRINTF(2, 3);
+
+#define swaybg_trace_begin(name) do { \
+		if (_swaybg_trace_enabled) { \
+			_swaybg_trace_span('B', name); \
+		} \
+	} while (0)
+
+#define swaybg_trace_end(name) do { \
+		if (_swaybg_trace_enabled) { \
+			_swaybg_trace_span('E', name); \
+		} \
+	} while (0)
+
+#define swaybg_trace_instant(name, fmt, ...) do { \
+		if (_swaybg_trace_enabled) { \
+			_swaybg_trace_instant(name, fmt, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+#endif
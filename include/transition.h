@@ -0,0 +1,56 @@
+#ifndef _SWAYBG_TRANSITION_H
+#define _SWAYBG_TRANSITION_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "pool-buffer.h"
+
+typedef void (*transition_done_func_t)(struct pool_buffer *to, void *data);
+
+/*
+ * A crossfade between two pre-rendered buffers of the same size, presented
+ * on `surface` one blended frame per wl_surface.frame callback. Only the
+ * pixels are blended, cairo is never involved.
+ */
+struct transition {
+	struct wl_surface *surface;
+	struct wl_shm *shm;
+	int width, height;
+
+	struct pool_buffer from, to;
+	// Blend targets, two so one can be drawn while the other is shown
+	struct pool_buffer frames[2];
+	bool busy[2];
+
+	struct wl_callback *frame_callback;
+	uint32_t duration, start; // in ms
+	bool started;
+
+	transition_done_func_t done;
+	void *data;
+};
+
+/*
+ * Start fading `surface` from `from` to `to`, taking ownership of both, on
+ * the next surface commit. Once `to` is attached, `done` is called to hand
+ * it back and the transition frees itself. Returns NULL, leaving both
+ * buffers untouched, on failure.
+ */
+struct transition *transition_start(struct wl_surface *surface,
+		struct wl_shm *shm, struct pool_buffer *from, struct pool_buffer *to,
+		int width, int height, uint32_t duration,
+		transition_done_func_t done, void *data);
+/*
+ * Skip to the end: attach and commit `to`, hand it back with `done`, and
+ * free the transition, e.g. when no more frame callbacks will come.
+ */
+void transition_finish(struct transition *transition);
+// Cancel a transition, without calling its done callback
+void transition_destroy(struct transition *transition);
+
+// dst = a + (b - a) * t / 256 on each 8-bit channel, with t from 0 to 256
+void blend_pixels(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+		size_t n, uint32_t t);
+
+#endif
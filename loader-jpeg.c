@@ -0,0 +1,153 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <jpeglib.h>
+#include "image-loader.h"
+#include "log.h"
+
+struct jpeg_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+static void handle_jpeg_error(j_common_ptr cinfo) {
+	struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	swaybg_log(LOG_ERROR, "Failed to decode JPEG image: %s", msg);
+	longjmp(err->env, 1);
+}
+
+static void handle_jpeg_message(j_common_ptr cinfo) {
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	swaybg_log(LOG_DEBUG, "libjpeg: %s", msg);
+}
+
+static uint32_t exif_read(const uint8_t *p, int size, bool big_endian) {
+	uint32_t v = 0;
+	for (int i = 0; i < size; ++i) {
+		v |= (uint32_t)p[big_endian ? i : size - 1 - i] << (8 * (size - 1 - i));
+	}
+	return v;
+}
+
+/*
+ * Returns the EXIF orientation (1-8) stored in an APP1 marker, or 1 if there
+ * is none.
+ */
+static int exif_orientation(const uint8_t *data, size_t len) {
+	if (len < 14 || memcmp(data, "Exif\0\0", 6) != 0) {
+		return 1;
+	}
+	const uint8_t *tiff = data + 6;
+	len -= 6;
+
+	bool big_endian;
+	if (memcmp(tiff, "MM", 2) == 0) {
+		big_endian = true;
+	} else if (memcmp(tiff, "II", 2) == 0) {
+		big_endian = false;
+	} else {
+		return 1;
+	}
+
+	uint32_t ifd = exif_read(tiff + 4, 4, big_endian);
+	if (ifd > len - 2) {
+		return 1;
+	}
+	uint32_t count = exif_read(tiff + ifd, 2, big_endian);
+	for (uint32_t i = 0; i < count; ++i) {
+		size_t entry = ifd + 2 + i * 12;
+		if (entry + 12 > len) {
+			break;
+		}
+		if (exif_read(tiff + entry, 2, big_endian) == 0x0112) {
+			uint32_t value = exif_read(tiff + entry + 8, 2, big_endian);
+			return value >= 1 && value <= 8 ? (int)value : 1;
+		}
+	}
+	return 1;
+}
+
+cairo_surface_t *load_jpeg_image(FILE *file, struct image_sink *sink) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error err;
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = handle_jpeg_error;
+	err.pub.output_message = handle_jpeg_message;
+	if (setjmp(err.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		image_sink_abort(sink);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_CMYK ||
+			cinfo.jpeg_color_space == JCS_YCCK) {
+		swaybg_log(LOG_DEBUG, "CMYK JPEG images are not supported natively");
+		jpeg_destroy_decompress(&cinfo);
+		return NULL;
+	}
+
+	for (jpeg_saved_marker_ptr m = cinfo.marker_list; m; m = m->next) {
+		if (m->marker == JPEG_APP0 + 1) {
+			sink->orientation = parse_exif_orientation(
+				exif_orientation(m->data, m->data_length));
+			break;
+		}
+	}
+
+	// Let the IDCT do as much of the reduction as it can: libjpeg-turbo
+	// decodes at any multiple of 1/8 for a fraction of the full cost.
+	double scale = image_sink_min_scale(sink,
+		cinfo.image_width, cinfo.image_height);
+	sink->file_width = cinfo.image_width;
+	sink->file_height = cinfo.image_height;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.scale_denom = 8;
+	cinfo.scale_num = 8;
+	while (cinfo.scale_num > 1 && cinfo.scale_num - 1 >= 8 * scale) {
+		--cinfo.scale_num;
+	}
+	jpeg_start_decompress(&cinfo);
+
+	if (!image_sink_begin(sink, cinfo.output_width, cinfo.output_height,
+			false)) {
+		jpeg_destroy_decompress(&cinfo);
+		return NULL;
+	}
+
+#if HAVE_JPEG_SKIP_SCANLINES
+	// Skip the iMCU columns and the rows outside of the kept region. The
+	// columns are widened to iMCU boundaries, which the sink trims. Chroma
+	// upsampling treats the last column as the image's edge, so one more is
+	// decoded than is kept.
+	JDIMENSION x = sink->region_x, width = sink->region_width;
+	if (x + width < cinfo.output_width) {
+		++width;
+	}
+	jpeg_crop_scanline(&cinfo, &x, &width);
+	sink->row_x = x;
+	image_sink_skip_rows(sink,
+		jpeg_skip_scanlines(&cinfo, sink->region_y));
+#endif
+
+	JSAMPARRAY row = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo,
+		JPOOL_IMAGE, cinfo.output_width * cinfo.output_components, 1);
+	while (cinfo.output_scanline < cinfo.output_height &&
+			!image_sink_done(sink)) {
+		jpeg_read_scanlines(&cinfo, row, 1);
+		image_sink_write_row(sink, row[0], IMAGE_ROW_RGB);
+	}
+	// Rows past the region are left undecoded
+	if (cinfo.output_scanline == cinfo.output_height) {
+		jpeg_finish_decompress(&cinfo);
+	}
+	jpeg_destroy_decompress(&cinfo);
+	return image_sink_finish(sink);
+}
@@ -0,0 +1,131 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "cairo_util.h"
+#include "image-loader.h"
+#include "log.h"
+
+#define GDK_PIXBUF_LIBRARY "libgdk_pixbuf-2.0.so.0"
+
+/*
+ * gdk-pixbuf drags in GLib, GObject, GModule and its loader cache, which
+ * most configurations never need, so it is only loaded when an image needs
+ * it. Only its headers are used at build time.
+ */
+static struct {
+	void *handle;
+	GdkPixbufLoader *(*loader_new)(void);
+	gboolean (*loader_write)(GdkPixbufLoader *loader, const guchar *buf,
+		gsize count, GError **error);
+	gboolean (*loader_close)(GdkPixbufLoader *loader, GError **error);
+	GdkPixbuf *(*loader_get_pixbuf)(GdkPixbufLoader *loader);
+	const gchar *(*get_option)(GdkPixbuf *pixbuf, const gchar *key);
+	int (*get_n_channels)(const GdkPixbuf *pixbuf);
+	int (*get_width)(const GdkPixbuf *pixbuf);
+	int (*get_height)(const GdkPixbuf *pixbuf);
+	int (*get_rowstride)(const GdkPixbuf *pixbuf);
+	const guint8 *(*read_pixels)(const GdkPixbuf *pixbuf);
+	gpointer (*object_ref)(gpointer object);
+	void (*object_unref)(gpointer object);
+	void (*error_free)(GError *error);
+} gdk;
+
+static pthread_once_t gdk_once = PTHREAD_ONCE_INIT;
+
+static bool load_symbol(void *dest, const char *name) {
+	// The library's dependencies are searched too, for the GObject ones
+	void *sym = dlsym(gdk.handle, name);
+	if (!sym) {
+		swaybg_log(LOG_ERROR, "Failed to find %s in %s",
+			name, GDK_PIXBUF_LIBRARY);
+		return false;
+	}
+	*(void **)dest = sym;
+	return true;
+}
+
+static void open_gdk_pixbuf(void) {
+	gdk.handle = dlopen(GDK_PIXBUF_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+	if (!gdk.handle) {
+		swaybg_log(LOG_ERROR, "Failed to load %s: %s",
+			GDK_PIXBUF_LIBRARY, dlerror());
+		return;
+	}
+	bool ok = load_symbol(&gdk.loader_new, "gdk_pixbuf_loader_new") &&
+		load_symbol(&gdk.loader_write, "gdk_pixbuf_loader_write") &&
+		load_symbol(&gdk.loader_close, "gdk_pixbuf_loader_close") &&
+		load_symbol(&gdk.loader_get_pixbuf, "gdk_pixbuf_loader_get_pixbuf") &&
+		load_symbol(&gdk.get_option, "gdk_pixbuf_get_option") &&
+		load_symbol(&gdk.get_n_channels, "gdk_pixbuf_get_n_channels") &&
+		load_symbol(&gdk.get_width, "gdk_pixbuf_get_width") &&
+		load_symbol(&gdk.get_height, "gdk_pixbuf_get_height") &&
+		load_symbol(&gdk.get_rowstride, "gdk_pixbuf_get_rowstride") &&
+		load_symbol(&gdk.read_pixels, "gdk_pixbuf_read_pixels") &&
+		load_symbol(&gdk.object_ref, "g_object_ref") &&
+		load_symbol(&gdk.object_unref, "g_object_unref") &&
+		load_symbol(&gdk.error_free, "g_error_free");
+	if (!ok) {
+		dlclose(gdk.handle);
+		gdk.handle = NULL;
+		return;
+	}
+	swaybg_log(LOG_DEBUG, "Loaded %s", GDK_PIXBUF_LIBRARY);
+}
+
+static GdkPixbuf *load_pixbuf(const struct image_file *file) {
+	GError *err = NULL;
+	GdkPixbufLoader *loader = gdk.loader_new();
+	GdkPixbuf *pixbuf = NULL;
+	bool written = gdk.loader_write(loader, file->data, file->size, &err);
+	if (!written) {
+		// Closing is required even after a failed write
+		gdk.loader_close(loader, NULL);
+	}
+	if (written && gdk.loader_close(loader, &err)) {
+		pixbuf = gdk.loader_get_pixbuf(loader);
+		if (pixbuf) {
+			gdk.object_ref(pixbuf);
+		} else {
+			swaybg_log(LOG_ERROR, "Failed to load background image "
+				"(No image data in %s).", file->path);
+		}
+	} else {
+		swaybg_log(LOG_ERROR, "Failed to load background image (%s).",
+			err->message);
+		gdk.error_free(err);
+	}
+	gdk.object_unref(loader);
+	return pixbuf;
+}
+
+cairo_surface_t *load_pixbuf_image(const struct image_file *file,
+		enum wl_output_transform *orientation) {
+	pthread_once(&gdk_once, open_gdk_pixbuf);
+	if (!gdk.handle) {
+		return NULL;
+	}
+	GdkPixbuf *pixbuf = load_pixbuf(file);
+	if (!pixbuf) {
+		return NULL;
+	}
+
+	// Embedded orientation is applied when rendering rather than by
+	// rotating a copy of the pixels
+	const char *exif = gdk.get_option(pixbuf, "orientation");
+	*orientation = exif ? parse_exif_orientation(atoi(exif)) :
+		WL_OUTPUT_TRANSFORM_NORMAL;
+	cairo_surface_t *image = NULL;
+	const guint8 *pixels = gdk.read_pixels(pixbuf);
+	if (pixels) {
+		image = cairo_image_surface_create_from_pixbuf_data(pixels,
+			gdk.get_n_channels(pixbuf), gdk.get_width(pixbuf),
+			gdk.get_height(pixbuf), gdk.get_rowstride(pixbuf));
+	}
+	if (!image) {
+		swaybg_log(LOG_ERROR, "Failed to convert %s to an image surface",
+			file->path);
+	}
+	gdk.object_unref(pixbuf);
+	return image;
+}
@@ -0,0 +1,106 @@
+#include <png.h>
+#include <stdlib.h>
+#include "image-loader.h"
+#include "log.h"
+
+static void handle_png_error(png_structp png, png_const_charp msg) {
+	swaybg_log(LOG_ERROR, "Failed to decode PNG image: %s", msg);
+	png_longjmp(png, 1);
+}
+
+static void handle_png_warning(png_structp png, png_const_charp msg) {
+	swaybg_log(LOG_DEBUG, "libpng: %s", msg);
+}
+
+cairo_surface_t *load_png_image(FILE *file, struct image_sink *sink) {
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+		handle_png_error, handle_png_warning);
+	if (!png) {
+		return NULL;
+	}
+	png_infop info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return NULL;
+	}
+
+	png_bytep volatile row = NULL;
+	if (setjmp(png_jmpbuf(png))) {
+		free(row);
+		png_destroy_read_struct(&png, &info, NULL);
+		image_sink_abort(sink);
+		return NULL;
+	}
+
+	png_init_io(png, file);
+	png_read_info(png, info);
+
+	png_uint_32 width, height;
+	int bit_depth, color_type, interlace;
+	png_get_IHDR(png, info, &width, &height, &bit_depth, &color_type,
+		&interlace, NULL, NULL);
+
+	// Normalize everything to 8-bit RGB or RGBA
+	if (color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_set_palette_to_rgb(png);
+	}
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+		png_set_expand_gray_1_2_4_to_8(png);
+	}
+	if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+		png_set_tRNS_to_alpha(png);
+	}
+	if (bit_depth == 16) {
+		png_set_strip_16(png);
+	}
+	if (color_type == PNG_COLOR_TYPE_GRAY ||
+			color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+		png_set_gray_to_rgb(png);
+	}
+	// Interlaced rows are read a pass at a time, without libpng combining
+	// them, which would need the whole image in memory
+	sink->interlaced = interlace != PNG_INTERLACE_NONE;
+	png_read_update_info(png, info);
+
+	bool alpha = png_get_channels(png, info) == 4;
+	enum image_row_format format = alpha ? IMAGE_ROW_RGBA : IMAGE_ROW_RGB;
+	size_t rowbytes = png_get_rowbytes(png, info);
+
+	if (!image_sink_begin(sink, width, height, alpha)) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return NULL;
+	}
+
+	row = malloc(rowbytes);
+	if (!row) {
+		png_error(png, "out of memory");
+	}
+	if (!sink->interlaced) {
+		// Rows above the region still have to be inflated, but the ones
+		// below it are never read
+		for (png_uint_32 y = 0; y < height && !image_sink_done(sink); ++y) {
+			png_read_row(png, row, NULL);
+			image_sink_write_row(sink, row, format);
+		}
+		if (sink->src_row == (int)height) {
+			png_read_end(png, NULL);
+		}
+	} else {
+		for (int pass = 0; pass < PNG_INTERLACE_ADAM7_PASSES; ++pass) {
+			png_uint_32 cols = PNG_PASS_COLS(width, pass);
+			png_uint_32 rows = PNG_PASS_ROWS(height, pass);
+			// libpng skips empty passes
+			for (png_uint_32 y = 0; cols > 0 && y < rows; ++y) {
+				png_read_row(png, row, NULL);
+				image_sink_write_pixels(sink, row, format,
+					PNG_ROW_FROM_PASS_ROW(y, pass), PNG_PASS_START_COL(pass),
+					PNG_PASS_COL_OFFSET(pass), cols);
+			}
+		}
+		png_read_end(png, NULL);
+	}
+
+	free(row);
+	png_destroy_read_struct(&png, &info, NULL);
+	return image_sink_finish(sink);
+}
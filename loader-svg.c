@@ -0,0 +1,118 @@
+#include <librsvg/rsvg.h>
+#include <math.h>
+#include <stdlib.h>
+#include "image-loader.h"
+#include "log.h"
+
+struct svg_image {
+	RsvgHandle *handle;
+	// The document's intrinsic size, and the part of it that is shown
+	double width, height;
+	struct image_box crop;
+};
+
+// The document's size in pixels, from its width and height or its viewBox
+static bool get_svg_size(RsvgHandle *handle, double *width, double *height) {
+	if (rsvg_handle_get_intrinsic_size_in_pixels(handle, width, height) &&
+			*width > 0 && *height > 0) {
+		return true;
+	}
+	gboolean has_width, has_height, has_viewbox;
+	RsvgLength width_length, height_length;
+	RsvgRectangle viewbox;
+	rsvg_handle_get_intrinsic_dimensions(handle, &has_width, &width_length,
+		&has_height, &height_length, &has_viewbox, &viewbox);
+	if (has_viewbox && viewbox.width > 0 && viewbox.height > 0) {
+		*width = viewbox.width;
+		*height = viewbox.height;
+		return true;
+	}
+	return false;
+}
+
+struct svg_image *load_svg_image(const struct image_file *file,
+		const struct image_crop *crop, double *width, double *height) {
+	// Relative references in the document resolve next to the file
+	GInputStream *stream = g_memory_input_stream_new_from_data(file->data,
+		file->size, NULL);
+	GFile *base = g_file_new_for_path(file->path);
+	GError *err = NULL;
+	RsvgHandle *handle = rsvg_handle_new_from_stream_sync(stream, base,
+		RSVG_HANDLE_FLAGS_NONE, NULL, &err);
+	g_object_unref(base);
+	g_object_unref(stream);
+	if (!handle) {
+		swaybg_log(LOG_DEBUG, "Failed to parse SVG image (%s)", err->message);
+		g_error_free(err);
+		return NULL;
+	}
+
+	struct svg_image *svg = calloc(1, sizeof(struct svg_image));
+	if (!svg) {
+		swaybg_log(LOG_ERROR, "Failed to allocate SVG image");
+		g_object_unref(handle);
+		return NULL;
+	}
+	svg->handle = handle;
+	if (!get_svg_size(handle, &svg->width, &svg->height)) {
+		swaybg_log(LOG_ERROR, "SVG image %s has neither a size nor a viewBox",
+			file->path);
+		destroy_svg_image(svg);
+		return NULL;
+	}
+
+	svg->crop = (struct image_box){ 0, 0, svg->width, svg->height };
+	if (crop) {
+		double x0 = fmax(crop->x, 0), y0 = fmax(crop->y, 0);
+		double x1 = fmin(crop->x + crop->width, svg->width);
+		double y1 = fmin(crop->y + crop->height, svg->height);
+		if (x0 < x1 && y0 < y1) {
+			svg->crop = (struct image_box){ x0, y0, x1 - x0, y1 - y0 };
+		}
+	}
+	*width = svg->crop.width;
+	*height = svg->crop.height;
+	return svg;
+}
+
+cairo_surface_t *render_svg_image(struct svg_image *svg,
+		int surface_width, int surface_height,
+		double x, double y, double width, double height) {
+	cairo_surface_t *surface = cairo_image_surface_create(
+		CAIRO_FORMAT_ARGB32, surface_width, surface_height);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		swaybg_log(LOG_ERROR, "Failed to allocate %dx%d SVG raster",
+			surface_width, surface_height);
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+
+	// Scaling the document rather than the viewport also stretches it
+	cairo_t *cairo = cairo_create(surface);
+	cairo_translate(cairo, -x, -y);
+	cairo_scale(cairo, width / svg->crop.width, height / svg->crop.height);
+	RsvgRectangle viewport = {
+		.x = -svg->crop.x,
+		.y = -svg->crop.y,
+		.width = svg->width,
+		.height = svg->height,
+	};
+	GError *err = NULL;
+	if (!rsvg_handle_render_document(svg->handle, cairo, &viewport, &err)) {
+		swaybg_log(LOG_ERROR, "Failed to render SVG image (%s)", err->message);
+		g_error_free(err);
+		cairo_destroy(cairo);
+		cairo_surface_destroy(surface);
+		return NULL;
+	}
+	cairo_destroy(cairo);
+	return surface;
+}
+
+void destroy_svg_image(struct svg_image *svg) {
+	if (!svg) {
+		return;
+	}
+	g_object_unref(svg->handle);
+	free(svg);
+}
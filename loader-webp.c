@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <webp/decode.h>
+#include "image-loader.h"
+#include "log.h"
+
+#define WEBP_CHUNK_SIZE (64 * 1024)
+
+cairo_surface_t *load_webp_image(FILE *file, struct image_sink *sink) {
+	WebPDecoderConfig config;
+	if (!WebPInitDecoderConfig(&config)) {
+		return NULL;
+	}
+
+	uint8_t *chunk = malloc(WEBP_CHUNK_SIZE);
+	if (!chunk) {
+		swaybg_log(LOG_ERROR, "Failed to allocate WebP read buffer");
+		return NULL;
+	}
+
+	size_t len = fread(chunk, 1, WEBP_CHUNK_SIZE, file);
+	VP8StatusCode status = WebPGetFeatures(chunk, len, &config.input);
+	if (status != VP8_STATUS_OK) {
+		swaybg_log(LOG_DEBUG, "Failed to read WebP header (status %d)", status);
+		free(chunk);
+		return NULL;
+	}
+	if (config.input.has_animation) {
+		swaybg_log(LOG_DEBUG, "Animated WebP images are not supported natively");
+		free(chunk);
+		return NULL;
+	}
+
+	if (!image_sink_begin(sink, config.input.width, config.input.height,
+			config.input.has_alpha)) {
+		free(chunk);
+		return NULL;
+	}
+
+	// libwebp crops and rescales while it decodes, so let it write rows
+	// straight into the destination surface instead of going through the
+	// sink.
+	config.options.use_cropping = sink->region_width < config.input.width ||
+		sink->region_height < config.input.height;
+	config.options.crop_left = sink->region_x;
+	config.options.crop_top = sink->region_y;
+	config.options.crop_width = sink->region_width;
+	config.options.crop_height = sink->region_height;
+	config.options.use_scaling = sink->factor > 1;
+	config.options.scaled_width = sink->width;
+	config.options.scaled_height = sink->height;
+	sink->resampled = config.options.use_scaling;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	config.output.colorspace = MODE_bgrA;
+#else
+	config.output.colorspace = MODE_Argb;
+#endif
+	int stride = cairo_image_surface_get_stride(sink->surface);
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = cairo_image_surface_get_data(sink->surface);
+	config.output.u.RGBA.stride = stride;
+	config.output.u.RGBA.size = (size_t)stride * sink->height;
+
+	WebPIDecoder *idec = WebPIDecode(NULL, 0, &config);
+	status = idec ? WebPIAppend(idec, chunk, len) : VP8_STATUS_OUT_OF_MEMORY;
+	while (status == VP8_STATUS_SUSPENDED &&
+			(len = fread(chunk, 1, WEBP_CHUNK_SIZE, file)) > 0) {
+		status = WebPIAppend(idec, chunk, len);
+	}
+	WebPIDelete(idec);
+	WebPFreeDecBuffer(&config.output);
+	free(chunk);
+
+	if (status != VP8_STATUS_OK) {
+		swaybg_log(LOG_ERROR, "Failed to decode WebP image (status %d)",
+			status);
+		image_sink_abort(sink);
+		return NULL;
+	}
+	return image_sink_finish(sink);
+}
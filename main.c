@@ -1,20 +1,41 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#if HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+#include <math.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <wayland-client.h>
 #include "background-image.h"
 #include "cairo_util.h"
+#include "config-file.h"
+#include "decode-helper.h"
+#include "decode-thread.h"
+#include "effects.h"
+#include "event-loop.h"
+#include "hash-table.h"
 #include "log.h"
+#include "memory-pressure.h"
 #include "pool-buffer.h"
+#include "presentation.h"
+#include "trace.h"
+#include "transition.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
 #include "single-pixel-buffer-v1-client-protocol.h"
 #include "fractional-scale-v1-client-protocol.h"
+#include "xdg-output-unstable-v1-client-protocol.h"
+#include "wlr-output-power-management-unstable-v1-client-protocol.h"
 
 /*
  * If `color` is a hexadecimal string of the form 'rrggbb' or '#rrggbb',
@@ -49,30 +70,65 @@ struct swaybg_state {
 	struct wp_viewporter *viewporter;
 	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
 	struct wp_fractional_scale_manager_v1 *fract_scale_manager;
+	struct zxdg_output_manager_v1 *xdg_output_manager;
+	struct wp_presentation *presentation;
+	struct zwlr_output_power_manager_v1 *output_power_manager;
 	struct wl_list configs;  // struct swaybg_output_config::link
 	struct wl_list outputs;  // struct swaybg_output::link
 	struct wl_list images;   // struct swaybg_image::link
+	// Configs by output, and those whose output is a pattern, in the order
+	// they were given
+	struct hash_table config_table;
+	struct swaybg_output_config **glob_configs;
+	size_t n_glob_configs;
+	struct hash_table image_paths; // interned, owning every image path
+	uint32_t transition_ms;
+	uint64_t memory_budget; // in bytes, 0 for none
+	bool decode_helper;
+	bool progressive;
+	struct event_source *decode_done;
+	struct memory_monitor *memory_monitor;
+	struct timespec last_reclaim;
+
+	struct event_loop *loop;
+	struct event_source *display_source;
+	uint32_t display_events;
+	bool display_read; // whether the last poll ended the pending read
 	bool run_display;
 };
 
 struct swaybg_image {
 	struct wl_list link;
 	const char *path;
+	const struct image_crop *crop; // NULL for the whole image
+	struct image_file file;
+	// Kept after rendering, to render again without decoding
+	struct background_image *decoded;
+	// Decoding the image in full while `decoded` is a quick preview of it
+	struct decode_thread *decode_thread;
 	bool load_required;
 };
 
 struct swaybg_output_config {
 	char *output;
 	const char *image_path;
+	struct image_crop crop; // zero width for the whole image
 	struct swaybg_image *image;
 	enum background_mode mode;
 	uint32_t color;
+	struct background_effects effects;
 	struct wl_list link;
 };
 
+// A rectangle in the compositor's logical output layout
+struct layout_box {
+	int32_t x, y, width, height;
+};
+
 struct swaybg_output {
 	uint32_t wl_name;
 	struct wl_output *wl_output;
+	struct zxdg_output_v1 *xdg_output;
 	char *name;
 	char *identifier;
 
@@ -83,23 +139,140 @@ struct swaybg_output {
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct wp_viewport *viewport;
 	struct wp_fractional_scale_v1 *fract_scale;
+	struct zwlr_output_power_v1 *power;
 
 	uint32_t width, height;
 	int32_t scale;
 	uint32_t pref_fract_scale;
+	enum wl_output_transform transform;
+	struct layout_box layout; // empty until known from xdg-output
+	// Fraction of the full buffer resolution that fits the memory budget,
+	// and how many times allocating a buffer failed and halved it
+	double resolution;
+	int alloc_failures;
 
 	uint32_t configure_serial;
+	bool configured; // whether the layer surface got its first configure
 	bool dirty, needs_ack;
-	// dimensions of the wl_buffer attached to the wl_surface
+	// While the output is off, frames are left dirty until it is back on
+	bool powered_off;
+	// The output's current mode, in physical pixels
+	int32_t mode_width, mode_height;
+	// dimensions and transform of the wl_buffer attached to the wl_surface
 	uint32_t buffer_width, buffer_height;
+	enum wl_output_transform buffer_transform;
+	struct layout_box buffer_span;
+
+	// With transitions enabled, the pixels of the attached buffer are kept to
+	// fade from when the image changes
+	struct pool_buffer current;
+	// Until the first configure, the size is predicted from the mode, and
+	// the buffer drawn for it ahead of time. `speculative_pixels` owns
+	// `speculative` unless it is a single-pixel buffer.
+	struct wl_buffer *speculative;
+	struct pool_buffer speculative_pixels;
+	struct transition *transition;
+
+	// What the next frame waits for, and how long frames took to show
+	struct frame_times frame;
+	struct presentation_stats presentation;
+	struct wl_list feedbacks;
 
 	struct wl_list link;
 };
 
-// Create a wl_buffer with the specified dimensions and content
+// This output's place in the layout
+static struct layout_box get_layout_box(const struct swaybg_output *output) {
+	if (output->layout.width > 0 && output->layout.height > 0) {
+		return output->layout;
+	}
+	// Not known without xdg-output, so it can only span itself
+	return (struct layout_box){
+		.width = output->width,
+		.height = output->height,
+	};
+}
+
+/*
+ * Return the bounding box of the outputs showing the same image in span mode
+ * as `output`, itself included. Outside of span mode, the box is empty.
+ */
+static struct layout_box get_span(const struct swaybg_output *output) {
+	struct layout_box span = {0};
+	if (output->config->mode != BACKGROUND_MODE_SPAN) {
+		return span;
+	}
+	span = get_layout_box(output);
+	if (output->layout.width <= 0 || output->layout.height <= 0) {
+		return span;
+	}
+
+	struct swaybg_output *other;
+	wl_list_for_each(other, &output->state->outputs, link) {
+		if (other == output || !other->config || other->width == 0 ||
+				other->config->mode != BACKGROUND_MODE_SPAN ||
+				other->config->image != output->config->image ||
+				other->layout.width <= 0 || other->layout.height <= 0) {
+			continue;
+		}
+		const struct layout_box *box = &other->layout;
+		int32_t x1 = span.x + span.width, y1 = span.y + span.height;
+		if (box->x + box->width > x1) {
+			x1 = box->x + box->width;
+		}
+		if (box->y + box->height > y1) {
+			y1 = box->y + box->height;
+		}
+		if (box->x < span.x) {
+			span.x = box->x;
+		}
+		if (box->y < span.y) {
+			span.y = box->y;
+		}
+		span.width = x1 - span.x;
+		span.height = y1 - span.y;
+	}
+	return span;
+}
+
+/*
+ * Return the area the image is fitted to, relative to the upright width x
+ * height buffer: the whole span in span mode, otherwise the buffer itself.
+ */
+static struct layout_box get_image_area(const struct swaybg_output *output,
+		uint32_t width, uint32_t height) {
+	struct layout_box area = { .width = width, .height = height };
+	if (output->config->mode != BACKGROUND_MODE_SPAN ||
+			output->width == 0 || output->height == 0) {
+		return area;
+	}
+	struct layout_box span = get_span(output);
+	struct layout_box own = get_layout_box(output);
+	double scale_x = (double)width / output->width;
+	double scale_y = (double)height / output->height;
+	area.x = lround((span.x - own.x) * scale_x);
+	area.y = lround((span.y - own.y) * scale_y);
+	area.width = lround(span.width * scale_x);
+	area.height = lround(span.height * scale_y);
+	return area;
+}
+
+/*
+ * Create a wl_buffer with the specified dimensions and content. If `keep` is
+ * set, the shm buffer is moved there instead of being unmapped, and owns the
+ * returned wl_buffer.
+ */
 static struct wl_buffer *draw_buffer(const struct swaybg_output *output,
-		cairo_surface_t *surface, uint32_t buffer_width, uint32_t buffer_height) {
+		struct background_image *image,
+		uint32_t buffer_width, uint32_t buffer_height,
+		struct pool_buffer *keep) {
 	uint32_t bg_color = output->config->color ? output->config->color : 0x000000ff;
+	const struct background_effects *effects = &output->config->effects;
+	// Without an image there is nothing to blur, only the color to dim
+	bool apply_effects = image && background_effects_enabled(effects);
+	if (!apply_effects && effects->dim > 0) {
+		bg_color = dim_color_u32(effects, bg_color);
+	}
 
 	if (buffer_width == 1 && buffer_height == 1 &&
 			output->config->mode == BACKGROUND_MODE_SOLID_COLOR &&
@@ -119,18 +292,59 @@ static struct wl_buffer *draw_buffer(const struct swaybg_output *output,
 
 
 	struct pool_buffer buffer;
-	if (!create_buffer(&buffer, output->state->shm,
-			buffer_width, buffer_height, WL_SHM_FORMAT_XRGB8888)) {
+	swaybg_trace_begin("create_buffer");
+	bool created = create_buffer(&buffer, output->state->shm,
+		buffer_width, buffer_height, WL_SHM_FORMAT_XRGB8888);
+	swaybg_trace_end("create_buffer");
+	if (!created) {
 		return NULL;
 	}
 
 	cairo_t *cairo = buffer.cairo;
-	cairo_set_source_u32(cairo, bg_color);
-	cairo_paint(cairo);
+	if (!image) {
+		cairo_image_surface_fill(buffer.surface, 0, 0,
+			buffer_width, buffer_height, cairo_pixel_from_u32(bg_color));
+		cairo_surface_mark_dirty(buffer.surface);
+	} else {
+		// Render upright and let the matrix pre-rotate the content for the
+		// output, so the compositor can scan out the buffer unmodified
+		uint32_t width = buffer_width, height = buffer_height;
+		if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+			width = buffer_height;
+			height = buffer_width;
+		}
+		cairo_matrix_t matrix;
+		cairo_matrix_init_transform(&matrix, output->transform, width, height);
+		cairo_set_matrix(cairo, &matrix);
+		// In span mode, only this output's part of the span is drawn
+		struct layout_box area = get_image_area(output, width, height);
+		cairo_translate(cairo, area.x, area.y);
+		// Previews are only shown briefly, do not spend time filtering them
+		cairo_filter_t filter = output->config->image->decode_thread ?
+			CAIRO_FILTER_BILINEAR : CAIRO_FILTER_GOOD;
+		swaybg_trace_begin("render_background_image");
+		render_background_image(cairo, image, output->config->mode,
+			bg_color, area.width, area.height, filter);
+		swaybg_trace_end("render_background_image");
+	}
+
+	if (apply_effects) {
+		// Effects are sized in logical pixels
+		double scale = (double)buffer_width / output->width;
+		if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+			scale = (double)buffer_height / output->width;
+		}
+		cairo_surface_flush(buffer.surface);
+		swaybg_trace_begin("apply_background_effects");
+		apply_background_effects(effects, buffer.data,
+			buffer_width, buffer_height, buffer_width * 4, scale);
+		swaybg_trace_end("apply_background_effects");
+		cairo_surface_mark_dirty(buffer.surface);
+	}
 
-	if (surface) {
-		render_background_image(cairo, surface,
-			output->config->mode, buffer_width, buffer_height);
+	if (keep) {
+		*keep = buffer;
+		return buffer.buffer;
 	}
 
 	// return wl_buffer for caller to use and destroy
@@ -142,8 +356,8 @@ static struct wl_buffer *draw_buffer(const struct swaybg_output *output,
 
 #define FRACT_DENOM 120
 
-// Return the size of the buffer that should be attached to this output
-static void get_buffer_size(const struct swaybg_output *output,
+// Return the size of the buffer that would match the output's pixels
+static void get_full_buffer_size(const struct swaybg_output *output,
 		uint32_t *buffer_width, uint32_t *buffer_height) {
 	if (output->config->mode == BACKGROUND_MODE_SOLID_COLOR &&
 			output->state->viewporter) {
@@ -159,36 +373,203 @@ static void get_buffer_size(const struct swaybg_output *output,
 		*buffer_width = output->width * output->scale;
 		*buffer_height = output->height * output->scale;
 	}
+
+	if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+		uint32_t tmp = *buffer_width;
+		*buffer_width = *buffer_height;
+		*buffer_height = tmp;
+	}
 }
 
-static void render_frame(struct swaybg_output *output, cairo_surface_t *surface) {
+// Return the size of the buffer that should be attached to this output
+static void get_buffer_size(const struct swaybg_output *output,
+		uint32_t *buffer_width, uint32_t *buffer_height) {
+	get_full_buffer_size(output, buffer_width, buffer_height);
+
+	// Anything less than full resolution needs the viewport to scale it up
+	double resolution = output->resolution / (1 << output->alloc_failures);
+	if (output->viewport && resolution < 1) {
+		*buffer_width *= resolution;
+		*buffer_height *= resolution;
+		if (*buffer_width < 1) {
+			*buffer_width = 1;
+		}
+		if (*buffer_height < 1) {
+			*buffer_height = 1;
+		}
+	}
+}
+
+static bool buffer_needs_redraw(const struct swaybg_output *output) {
 	uint32_t buffer_width, buffer_height;
 	get_buffer_size(output, &buffer_width, &buffer_height);
+	struct layout_box span = get_span(output);
+	return buffer_width != output->buffer_width ||
+		buffer_height != output->buffer_height ||
+		output->transform != output->buffer_transform ||
+		memcmp(&span, &output->buffer_span, sizeof(span)) != 0;
+}
+
+static void transition_done(struct pool_buffer *to, void *data) {
+	struct swaybg_output *output = data;
+	destroy_buffer(&output->current);
+	output->current = *to;
+	output->transition = NULL;
+}
 
-	// Attach a new buffer if the desired size has changed
+// Whether `output` can crossfade to a freshly drawn buffer of this size
+static bool can_transition(const struct swaybg_output *output,
+		uint32_t buffer_width, uint32_t buffer_height) {
+	return output->current.buffer &&
+		output->transform == output->buffer_transform &&
+		(uint32_t)cairo_image_surface_get_width(output->current.surface) ==
+			buffer_width &&
+		(uint32_t)cairo_image_surface_get_height(output->current.surface) ==
+			buffer_height;
+}
+
+// Scale the attached buffer to the output, ask for feedback and commit
+static void commit_frame(struct swaybg_output *output) {
+	if (output->viewport) {
+		wp_viewport_set_destination(output->viewport, output->width, output->height);
+	} else {
+		wl_surface_set_buffer_scale(output->surface, output->scale);
+	}
+	if (output->state->presentation) {
+		presentation_request_feedback(output->state->presentation,
+			output->surface, &output->name, &output->frame,
+			&output->presentation, &output->feedbacks);
+	}
+	output->frame.configure = (struct timespec){0};
+	swaybg_trace_begin("wl_surface_commit");
+	wl_surface_commit(output->surface);
+	swaybg_trace_end("wl_surface_commit");
+}
+
+static void discard_speculative(struct swaybg_output *output) {
+	if (output->speculative_pixels.buffer) {
+		destroy_buffer(&output->speculative_pixels);
+	} else if (output->speculative) {
+		wl_buffer_destroy(output->speculative);
+	}
+	output->speculative = NULL;
+	output->speculative_pixels = (struct pool_buffer){0};
+}
+
+/*
+ * Draw the buffer for the predicted size, without attaching it: that has to
+ * wait for the configure. The buffer size fields describe it meanwhile.
+ */
+static void render_speculative(struct swaybg_output *output,
+		struct background_image *image,
+		uint32_t buffer_width, uint32_t buffer_height) {
+	discard_speculative(output);
+	swaybg_trace_begin("render_speculative");
+	struct pool_buffer pixels = {0};
+	struct wl_buffer *buf = draw_buffer(output, image,
+		buffer_width, buffer_height, &pixels);
+	swaybg_trace_end("render_speculative");
+	if (!buf) {
+		return;
+	}
+	output->speculative = buf;
+	output->speculative_pixels = pixels;
+	output->buffer_width = buffer_width;
+	output->buffer_height = buffer_height;
+	output->buffer_transform = output->transform;
+	output->buffer_span = get_span(output);
+}
+
+// Attach and commit the buffer drawn ahead, in answer to configure `serial`
+static void present_speculative(struct swaybg_output *output,
+		uint32_t serial) {
+	swaybg_log(LOG_DEBUG, "Output %s: configure matches the predicted "
+		"%ux%u, committing the buffer drawn for it", output->name,
+		output->width, output->height);
+	zwlr_layer_surface_v1_ack_configure(output->layer_surface, serial);
+	output->needs_ack = false;
+	output->dirty = false;
+	wl_surface_attach(output->surface, output->speculative, 0, 0);
+	wl_surface_damage_buffer(output->surface, 0, 0,
+		output->buffer_width, output->buffer_height);
+	wl_surface_set_buffer_transform(output->surface, output->buffer_transform);
+	commit_frame(output);
+
+	if (output->state->transition_ms && output->speculative_pixels.buffer) {
+		// Kept to fade from, like any buffer drawn with transitions on
+		destroy_buffer(&output->current);
+		output->current = output->speculative_pixels;
+		output->speculative = NULL;
+		output->speculative_pixels = (struct pool_buffer){0};
+	} else {
+		discard_speculative(output);
+	}
+}
+
+static void render_frame(struct swaybg_output *output,
+		struct background_image *image) {
+	uint32_t buffer_width, buffer_height;
+	get_buffer_size(output, &buffer_width, &buffer_height);
+
+	if (!output->configured) {
+		if (buffer_needs_redraw(output)) {
+			render_speculative(output, image, buffer_width, buffer_height);
+		}
+		return;
+	}
+
+	// Attach a new buffer if the desired size or transform has changed
 	struct wl_buffer *buf = NULL;
-	if (buffer_width != output->buffer_width ||
-			buffer_height != output->buffer_height) {
-		buf = draw_buffer(output, surface,
-			buffer_width, buffer_height);
+	if (buffer_needs_redraw(output)) {
+		// A redraw supersedes any fade in progress
+		transition_destroy(output->transition);
+		output->transition = NULL;
+
+		struct pool_buffer kept = {0};
+		buf = draw_buffer(output, image, buffer_width, buffer_height,
+			output->state->transition_ms ? &kept : NULL);
 		if (!buf) {
+			if (output->viewport && buffer_width * buffer_height > 1 &&
+					output->alloc_failures < 16) {
+				// Try again at half the resolution, stretched by the viewport
+				++output->alloc_failures;
+				swaybg_log(LOG_ERROR, "Failed to draw a %ux%u buffer for "
+					"output %s, retrying at lower resolution",
+					buffer_width, buffer_height, output->name);
+				render_frame(output, image);
+			}
 			return;
 		}
 
-		wl_surface_attach(output->surface, buf, 0, 0);
-		wl_surface_damage_buffer(output->surface, 0, 0,
-			buffer_width, buffer_height);
+		if (kept.buffer && can_transition(output, buffer_width, buffer_height)) {
+			output->transition = transition_start(output->surface,
+				output->state->shm, &output->current, &kept,
+				buffer_width, buffer_height, output->state->transition_ms,
+				transition_done, output);
+		}
+		if (!output->transition) {
+			wl_surface_attach(output->surface, buf, 0, 0);
+			wl_surface_damage_buffer(output->surface, 0, 0,
+				buffer_width, buffer_height);
+		}
+		if (kept.buffer) {
+			destroy_buffer(&output->current);
+			output->current = kept;
+		}
+		if (kept.buffer || output->transition) {
+			// Owned by the kept buffer or the transition
+			buf = NULL;
+		}
+
+		wl_surface_set_buffer_transform(output->surface, output->transform);
 
 		output->buffer_width = buffer_width;
 		output->buffer_height = buffer_height;
+		output->buffer_transform = output->transform;
+		output->buffer_span = get_span(output);
 	}
 
-	if (output->viewport) {
-		wp_viewport_set_destination(output->viewport, output->width, output->height);
-	} else {
-		wl_surface_set_buffer_scale(output->surface, output->scale);
-	}
-	wl_surface_commit(output->surface);
+	commit_frame(output);
 	if (buf) {
 		wl_buffer_destroy(buf);
 	}
@@ -199,23 +580,51 @@ static void destroy_swaybg_image(struct swaybg_image *image) {
 		return;
 	}
 	wl_list_remove(&image->link);
+	if (image->decode_thread) {
+		destroy_background_image(decode_thread_join(image->decode_thread));
+	}
+	destroy_background_image(image->decoded);
+	image_file_close(&image->file);
 	free(image);
 }
 
-static void destroy_swaybg_output_config(struct swaybg_output_config *config) {
+static void destroy_swaybg_output_config(struct swaybg_state *state,
+		struct swaybg_output_config *config) {
 	if (!config) {
 		return;
 	}
+	if (hash_table_get(&state->config_table, config->output) == config) {
+		hash_table_remove(&state->config_table, config->output);
+	}
 	wl_list_remove(&config->link);
 	free(config->output);
 	free(config);
 }
 
+// The layout changed: have the outputs in span mode check whether theirs did
+static void update_spans(struct swaybg_state *state) {
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->config && output->width > 0 &&
+				output->config->mode == BACKGROUND_MODE_SPAN) {
+			output->dirty = true;
+		}
+	}
+}
+
 static void destroy_swaybg_output(struct swaybg_output *output) {
 	if (!output) {
 		return;
 	}
 	wl_list_remove(&output->link);
+	if (output->config && output->config->mode == BACKGROUND_MODE_SPAN) {
+		update_spans(output->state);
+	}
+	transition_destroy(output->transition);
+	destroy_buffer(&output->current);
+	discard_speculative(output);
+	presentation_log_summary(output->name, &output->presentation);
+	presentation_cancel_feedback(&output->feedbacks);
 	if (output->layer_surface != NULL) {
 		zwlr_layer_surface_v1_destroy(output->layer_surface);
 	}
@@ -228,6 +637,12 @@ static void destroy_swaybg_output(struct swaybg_output *output) {
 	if (output->fract_scale != NULL) {
 		wp_fractional_scale_v1_destroy(output->fract_scale);
 	}
+	if (output->xdg_output != NULL) {
+		zxdg_output_v1_destroy(output->xdg_output);
+	}
+	if (output->power != NULL) {
+		zwlr_output_power_v1_destroy(output->power);
+	}
 	wl_output_destroy(output->wl_output);
 	free(output->name);
 	free(output->identifier);
@@ -238,10 +653,25 @@ static void layer_surface_configure(void *data,
 		struct zwlr_layer_surface_v1 *surface,
 		uint32_t serial, uint32_t width, uint32_t height) {
 	struct swaybg_output *output = data;
+	swaybg_trace_instant("configure", "%s %ux%u", output->name, width, height);
+	clock_gettime(CLOCK_MONOTONIC, &output->frame.configure);
+	bool first = !output->configured;
+	bool predicted = first && output->speculative &&
+		width == output->width && height == output->height;
+	output->configured = true;
 	output->width = width;
 	output->height = height;
-	output->dirty = true;
 	output->configure_serial = serial;
+	if (predicted && !buffer_needs_redraw(output)) {
+		present_speculative(output, serial);
+		return;
+	} else if (first) {
+		// The prediction missed, or its buffer is stale or was never drawn:
+		// nothing is attached yet, so draw from scratch
+		discard_speculative(output);
+		output->buffer_width = output->buffer_height = 0;
+	}
+	output->dirty = true;
 	output->needs_ack = true;
 }
 
@@ -261,6 +691,8 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 static void fract_preferred_scale(void *data, struct wp_fractional_scale_v1 *f,
 		uint32_t scale) {
 	struct swaybg_output *output = data;
+	swaybg_trace_instant("preferred_scale", "%s %u/%d",
+		output->name, scale, FRACT_DENOM);
 	output->pref_fract_scale = scale;
 }
 
@@ -268,15 +700,141 @@ static const struct wp_fractional_scale_v1_listener fract_scale_listener = {
 	.preferred_scale = fract_preferred_scale
 };
 
-static void output_geometry(void *data, struct wl_output *output, int32_t x,
+static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
 		int32_t y, int32_t width_mm, int32_t height_mm, int32_t subpixel,
 		const char *make, const char *model, int32_t transform) {
-	// Who cares
+	struct swaybg_output *output = data;
+	if (output->transform == (enum wl_output_transform)transform) {
+		return;
+	}
+	output->transform = transform;
+	if (output->state->run_display && output->width > 0 && output->height > 0) {
+		output->dirty = true;
+	}
+}
+
+static void xdg_output_logical_position(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
+	struct swaybg_output *output = data;
+	if (output->layout.x != x || output->layout.y != y) {
+		output->layout.x = x;
+		output->layout.y = y;
+		update_spans(output->state);
+	}
+}
+
+static void xdg_output_logical_size(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
+	struct swaybg_output *output = data;
+	if (output->layout.width != width || output->layout.height != height) {
+		output->layout.width = width;
+		output->layout.height = height;
+		update_spans(output->state);
+	}
+}
+
+static void xdg_output_done(void *data, struct zxdg_output_v1 *xdg_output) {
+	// Nothing to apply, each event takes effect when the outputs next update
+}
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+	.logical_position = xdg_output_logical_position,
+	.logical_size = xdg_output_logical_size,
+	.done = xdg_output_done,
+};
+
+static void get_xdg_output(struct swaybg_output *output) {
+	output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+		output->state->xdg_output_manager, output->wl_output);
+	zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener,
+		output);
+}
+
+/*
+ * Drop the decoded images only powered off outputs show, and the buffers
+ * those outputs keep for transitions. What they display stays on screen.
+ * Fades in progress jump to their end, as powered off outputs get no frame
+ * callbacks to finish them.
+ */
+static void release_powered_off(struct swaybg_state *state) {
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		bool shown = false;
+		struct swaybg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (!output->powered_off && output->config &&
+					output->config->image == image) {
+				shown = true;
+				break;
+			}
+		}
+		if (!shown && !image->decode_thread && image->decoded) {
+			swaybg_log(LOG_DEBUG, "Releasing %s, no output showing it "
+				"is on", image->path);
+			destroy_background_image(image->decoded);
+			image->decoded = NULL;
+		}
+	}
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->powered_off) {
+			if (output->transition) {
+				transition_finish(output->transition);
+			}
+			destroy_buffer(&output->current);
+			output->current = (struct pool_buffer){0};
+		}
+	}
+}
+
+static void output_power_mode(void *data, struct zwlr_output_power_v1 *power,
+		uint32_t mode) {
+	struct swaybg_output *output = data;
+	bool off = mode == ZWLR_OUTPUT_POWER_V1_MODE_OFF;
+	if (output->powered_off == off) {
+		return;
+	}
+	swaybg_trace_instant("power", "%s %s", output->name, off ? "off" : "on");
+	output->powered_off = off;
+	if (off) {
+		swaybg_log(LOG_DEBUG, "Output %s is off, deferring its frames",
+			output->name);
+		release_powered_off(output->state);
+	} else {
+		swaybg_log(LOG_DEBUG, "Output %s is on%s", output->name,
+			output->dirty ? ", drawing the deferred frame" : "");
+	}
 }
 
-static void output_mode(void *data, struct wl_output *output, uint32_t flags,
-		int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+static void output_power_failed(void *data, struct zwlr_output_power_v1 *power) {
+	struct swaybg_output *output = data;
+	// E.g. the output has no power management: treat it as always on
+	swaybg_log(LOG_DEBUG, "Cannot follow the power mode of output %s",
+		output->name);
+	zwlr_output_power_v1_destroy(output->power);
+	output->power = NULL;
+	output->powered_off = false;
+}
+
+static const struct zwlr_output_power_v1_listener output_power_listener = {
+	.mode = output_power_mode,
+	.failed = output_power_failed,
+};
+
+static void get_output_power(struct swaybg_output *output) {
+	output->power = zwlr_output_power_manager_v1_get_output_power(
+		output->state->output_power_manager, output->wl_output);
+	zwlr_output_power_v1_add_listener(output->power, &output_power_listener,
+		output);
+}
+
+static void output_mode(void *data, struct wl_output *wl_output,
+		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
+	struct swaybg_output *output = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		output->mode_width = width;
+		output->mode_height = height;
+	}
 }
 
 static void create_layer_surface(struct swaybg_output *output) {
@@ -298,9 +856,7 @@ static void create_layer_surface(struct swaybg_output *output) {
 			&fract_scale_listener, output);
 	}
 
-	if (output->state->viewporter &&
-			(output->config->mode == BACKGROUND_MODE_SOLID_COLOR ||
-				output->state->fract_scale_manager)) {
+	if (output->state->viewporter) {
 		output->viewport =  wp_viewporter_get_viewport(
 			output->state->viewporter, output->surface);
 	}
@@ -319,7 +875,37 @@ static void create_layer_surface(struct swaybg_output *output) {
 	zwlr_layer_surface_v1_set_exclusive_zone(output->layer_surface, -1);
 	zwlr_layer_surface_v1_add_listener(output->layer_surface,
 			&layer_surface_listener, output);
+	swaybg_trace_begin("wl_surface_commit");
 	wl_surface_commit(output->surface);
+	swaybg_trace_end("wl_surface_commit");
+}
+
+/*
+ * Guess the size of the first configure: the output's logical size, from
+ * xdg-output or else its mode. The next update draws the buffer for it while
+ * the configure is on its way.
+ */
+static void predict_size(struct swaybg_output *output) {
+	int32_t width = output->layout.width, height = output->layout.height;
+	if (width <= 0 || height <= 0) {
+		width = output->mode_width;
+		height = output->mode_height;
+		if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+			int32_t tmp = width;
+			width = height;
+			height = tmp;
+		}
+		width /= output->scale;
+		height /= output->scale;
+	}
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	swaybg_log(LOG_DEBUG, "Output %s: predicting a %dx%d configure",
+		output->name, width, height);
+	output->width = width;
+	output->height = height;
+	output->dirty = true;
 }
 
 static void output_done(void *data, struct wl_output *wl_output) {
@@ -332,40 +918,59 @@ static void output_done(void *data, struct wl_output *wl_output) {
 		swaybg_log(LOG_DEBUG, "Found config %s for output %s (%s)",
 				output->config->output, output->name, output->identifier);
 		create_layer_surface(output);
+		if (output->state->output_power_manager) {
+			get_output_power(output);
+		}
+		// Get the surface to the compositor before drawing ahead
+		wl_display_flush(output->state->display);
+		predict_size(output);
+	} else if (!output->configured) {
+		predict_size(output);
 	}
 }
 
 static void output_scale(void *data, struct wl_output *wl_output,
 		int32_t scale) {
 	struct swaybg_output *output = data;
+	swaybg_trace_instant("scale", "%s %d", output->name, scale);
 	output->scale = scale;
 	if (output->state->run_display && output->width > 0 && output->height > 0) {
 		output->dirty = true;
 	}
 }
 
-static void find_config(struct swaybg_output *output, const char *name) {
+/*
+ * Pick the config naming the output's identifier, else its name, else the
+ * first pattern matching either, else the one for all outputs.
+ */
+static void find_config(struct swaybg_output *output) {
+	struct swaybg_state *state = output->state;
 	struct swaybg_output_config *config = NULL;
-	wl_list_for_each(config, &output->state->configs, link) {
-		if (strcmp(config->output, name) == 0) {
-			output->config = config;
-			return;
-		} else if (!output->config && strcmp(config->output, "*") == 0) {
-			output->config = config;
+	if (output->identifier) {
+		config = hash_table_get(&state->config_table, output->identifier);
+	}
+	if (!config && output->name) {
+		config = hash_table_get(&state->config_table, output->name);
+	}
+	for (size_t i = 0; !config && i < state->n_glob_configs; ++i) {
+		const char *pattern = state->glob_configs[i]->output;
+		if ((output->identifier &&
+				fnmatch(pattern, output->identifier, 0) == 0) ||
+				(output->name && fnmatch(pattern, output->name, 0) == 0)) {
+			config = state->glob_configs[i];
 		}
 	}
+	if (!config) {
+		config = hash_table_get(&state->config_table, "*");
+	}
+	output->config = config;
 }
 
 static void output_name(void *data, struct wl_output *wl_output,
 		const char *name) {
 	struct swaybg_output *output = data;
 	output->name = strdup(name);
-
-	// If description was sent first, the config may already be populated. If
-	// there is an identifier config set, keep it.
-	if (!output->config || strcmp(output->config->output, "*") == 0) {
-		find_config(output, name);
-	}
+	find_config(output);
 }
 
 static void output_description(void *data, struct wl_output *wl_output,
@@ -385,7 +990,7 @@ static void output_description(void *data, struct wl_output *wl_output,
 		strncpy(output->identifier, description, length);
 		output->identifier[length - 1] = '\0';
 
-		find_config(output, output->identifier);
+		find_config(output);
 	}
 }
 
@@ -401,6 +1006,7 @@ static const struct wl_output_listener output_listener = {
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct swaybg_state *state = data;
+	swaybg_trace_instant("global", "%s %u v%u", interface, name, version);
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
 		state->compositor =
 			wl_registry_bind(registry, name, &wl_compositor_interface, 4);
@@ -410,11 +1016,16 @@ static void handle_global(void *data, struct wl_registry *registry,
 		struct swaybg_output *output = calloc(1, sizeof(struct swaybg_output));
 		output->state = state;
 		output->scale = 1;
+		output->resolution = 1;
 		output->wl_name = name;
+		wl_list_init(&output->feedbacks);
 		output->wl_output =
 			wl_registry_bind(registry, name, &wl_output_interface, 4);
 		wl_output_add_listener(output->wl_output, &output_listener, output);
 		wl_list_insert(&state->outputs, &output->link);
+		if (state->xdg_output_manager) {
+			get_xdg_output(output);
+		}
 	} else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
 		state->layer_shell =
 			wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 1);
@@ -428,12 +1039,36 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
 		state->fract_scale_manager = wl_registry_bind(registry, name,
 			&wp_fractional_scale_manager_v1_interface, 1);
+	} else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
+		state->xdg_output_manager = wl_registry_bind(registry, name,
+			&zxdg_output_manager_v1_interface, 1);
+		// Outputs announced before the manager
+		struct swaybg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			get_xdg_output(output);
+		}
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		state->presentation = wl_registry_bind(registry, name,
+			&wp_presentation_interface, 1);
+		presentation_init(state->presentation);
+	} else if (strcmp(interface,
+			zwlr_output_power_manager_v1_interface.name) == 0) {
+		state->output_power_manager = wl_registry_bind(registry, name,
+			&zwlr_output_power_manager_v1_interface, 1);
+		// Outputs already shown before the manager
+		struct swaybg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->layer_surface) {
+				get_output_power(output);
+			}
+		}
 	}
 }
 
 static void handle_global_remove(void *data, struct wl_registry *registry,
 		uint32_t name) {
 	struct swaybg_state *state = data;
+	swaybg_trace_instant("global_remove", "%u", name);
 	struct swaybg_output *output, *tmp;
 	wl_list_for_each_safe(output, tmp, &state->outputs, link) {
 		if (output->wl_name == name) {
@@ -452,36 +1087,223 @@ static const struct wl_registry_listener registry_listener = {
 
 static bool store_swaybg_output_config(struct swaybg_state *state,
 		struct swaybg_output_config *config) {
-	struct swaybg_output_config *oc = NULL;
-	wl_list_for_each(oc, &state->configs, link) {
-		if (strcmp(config->output, oc->output) == 0) {
-			// Merge on top
-			if (config->image_path) {
-				oc->image_path = config->image_path;
-			}
-			if (config->color) {
-				oc->color = config->color;
-			}
-			if (config->mode != BACKGROUND_MODE_INVALID) {
-				oc->mode = config->mode;
-			}
-			return false;
+	struct swaybg_output_config *oc =
+		hash_table_get(&state->config_table, config->output);
+	if (oc) {
+		// Merge on top
+		if (config->image_path) {
+			oc->image_path = config->image_path;
+		}
+		if (config->color) {
+			oc->color = config->color;
+		}
+		if (config->mode != BACKGROUND_MODE_INVALID) {
+			oc->mode = config->mode;
 		}
+		if (config->crop.width) {
+			oc->crop = config->crop;
+		}
+		if (background_effects_enabled(&config->effects)) {
+			oc->effects = config->effects;
+		}
+		return false;
 	}
 	// New config, just add it
+	if (!hash_table_set(&state->config_table, config->output, config)) {
+		swaybg_log(LOG_ERROR, "Failed to store config for output %s",
+			config->output);
+		return false;
+	}
 	wl_list_insert(&state->configs, &config->link);
 	return true;
 }
 
+static struct swaybg_output_config *create_output_config(const char *output) {
+	struct swaybg_output_config *config =
+		calloc(1, sizeof(struct swaybg_output_config));
+	if (!config) {
+		return NULL;
+	}
+	config->output = strdup(output);
+	if (!config->output) {
+		free(config);
+		return NULL;
+	}
+	config->mode = BACKGROUND_MODE_INVALID;
+	wl_list_init(&config->link); // init for safe removal
+	return config;
+}
+
+// Image paths are interned, so that images can be told apart by pointer
+static const char *intern_image_path(struct swaybg_state *state,
+		const char *path) {
+	const char *interned = hash_table_intern(&state->image_paths, path);
+	if (!interned) {
+		swaybg_log(LOG_ERROR, "Failed to store image path %s", path);
+	}
+	return interned;
+}
+
+// Apply a `key = value` line of a --config file
+static bool handle_config_line(const char *output, const char *key,
+		const char *value, void *data) {
+	struct swaybg_state *state = data;
+	struct swaybg_output_config *config =
+		hash_table_get(&state->config_table, output);
+	if (!config) {
+		config = create_output_config(output);
+		if (!config || !store_swaybg_output_config(state, config)) {
+			swaybg_log(LOG_ERROR, "Failed to allocate config for output %s",
+				output);
+			destroy_swaybg_output_config(state, config);
+			return false;
+		}
+	}
+
+	if (strcmp(key, "image") == 0) {
+		const char *path = intern_image_path(state, value);
+		if (path) {
+			config->image_path = path;
+		}
+		return path != NULL;
+	} else if (strcmp(key, "color") == 0) {
+		return parse_color(value, &config->color);
+	} else if (strcmp(key, "mode") == 0) {
+		enum background_mode mode = parse_background_mode(value);
+		if (mode != BACKGROUND_MODE_INVALID) {
+			config->mode = mode;
+		}
+		return mode != BACKGROUND_MODE_INVALID;
+	} else if (strcmp(key, "crop") == 0) {
+		return parse_image_crop(value, &config->crop);
+	} else if (strcmp(key, "effect") == 0) {
+		return parse_background_effects(value, &config->effects);
+	}
+	return false;
+}
+
+// Whether the config's output is matched as a pattern, other than "*"
+static bool is_glob_config(const struct swaybg_output_config *config) {
+	return strcmp(config->output, "*") != 0 &&
+		strpbrk(config->output, "*?[") != NULL;
+}
+
+// Options without a short form
+enum {
+	OPT_TRACE = 256,
+	OPT_TRANSITION,
+	OPT_MEMORY_BUDGET,
+	OPT_CROP,
+	OPT_DECODE_HELPER,
+	OPT_PROGRESSIVE,
+	OPT_CONFIG,
+};
+
+/*
+ * Parse a size in bytes with an optional K, M or G binary suffix. Returns
+ * false and leaves `*result` unmodified if invalid.
+ */
+static bool parse_size(const char *str, uint64_t *result) {
+	char *end;
+	errno = 0;
+	unsigned long long size = strtoull(str, &end, 10);
+	if (!isdigit(*str) || errno != 0) {
+		return false;
+	}
+	int shift = 0;
+	switch (toupper(*end)) {
+	case 'G':
+		shift += 10;
+		// fallthrough
+	case 'M':
+		shift += 10;
+		// fallthrough
+	case 'K':
+		shift += 10;
+		++end;
+		break;
+	}
+	if (*end != '\0' || size > UINT64_MAX >> shift) {
+		return false;
+	}
+	*result = (uint64_t)size << shift;
+	return true;
+}
+
+/*
+ * Look at argv[*i] the way getopt_long would, without disturbing getopt's
+ * state, which cannot be reset portably. Sets `*path` if it is --config and
+ * steps `*i` over any separate option argument. Returns false at "--".
+ */
+static bool find_config_arg(int argc, char **argv,
+		const struct option *long_options, int *i, const char **path) {
+	const char *arg = argv[*i];
+	if (strcmp(arg, "--") == 0) {
+		return false;
+	}
+	if (arg[0] != '-' || arg[1] == '\0') {
+		return true;
+	}
+
+	if (arg[1] != '-') {
+		for (const char *opt = arg + 1; *opt; ++opt) {
+			if (strchr("ceimo", *opt)) {
+				// The argument is the rest of this word or the next one
+				if (opt[1] == '\0') {
+					++*i;
+				}
+				break;
+			}
+		}
+		return true;
+	}
+
+	// Long options may be abbreviated to any unambiguous prefix
+	const char *name = arg + 2;
+	size_t len = strcspn(name, "=");
+	const struct option *match = NULL;
+	int matches = 0;
+	for (const struct option *opt = long_options; opt->name; ++opt) {
+		if (strncmp(opt->name, name, len) != 0) {
+			continue;
+		}
+		match = opt;
+		if (opt->name[len] == '\0') {
+			matches = 1;
+			break;
+		}
+		++matches;
+	}
+	if (matches != 1 || match->has_arg != required_argument) {
+		return true;
+	}
+	const char *value = name[len] == '=' ? name + len + 1 : NULL;
+	if (!value && *i + 1 < argc) {
+		value = argv[++*i];
+	}
+	if (match->val == OPT_CONFIG) {
+		*path = value;
+	}
+	return true;
+}
+
 static void parse_command_line(int argc, char **argv,
 		struct swaybg_state *state) {
 	static struct option long_options[] = {
 		{"color", required_argument, NULL, 'c'},
+		{"effect", required_argument, NULL, 'e'},
 		{"help", no_argument, NULL, 'h'},
 		{"image", required_argument, NULL, 'i'},
 		{"mode", required_argument, NULL, 'm'},
 		{"output", required_argument, NULL, 'o'},
 		{"version", no_argument, NULL, 'v'},
+		{"trace", required_argument, NULL, OPT_TRACE},
+		{"transition", required_argument, NULL, OPT_TRANSITION},
+		{"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+		{"crop", required_argument, NULL, OPT_CROP},
+		{"decode-helper", no_argument, NULL, OPT_DECODE_HELPER},
+		{"progressive", no_argument, NULL, OPT_PROGRESSIVE},
+		{"config", required_argument, NULL, OPT_CONFIG},
 		{0, 0, 0, 0}
 	};
 
@@ -489,24 +1311,42 @@ static void parse_command_line(int argc, char **argv,
 		"Usage: swaybg <options...>\n"
 		"\n"
 		"  -c, --color RRGGBB     Set the background color.\n"
+		"  -e, --effect <effects> Blur or dim the image, e.g. blur:8,dim:0.3.\n"
 		"  -h, --help             Show help message and quit.\n"
 		"  -i, --image <path>     Set the image to display.\n"
 		"  -m, --mode <mode>      Set the mode to use for the image.\n"
 		"  -o, --output <name>    Set the output to operate on or * for all.\n"
 		"  -v, --version          Show the version number and quit.\n"
+		"      --trace <file>     Write a Chrome trace-event timeline to file.\n"
+		"      --transition <ms>  Crossfade to reloaded images over ms.\n"
+		"      --memory-budget <size>\n"
+		"                         Lower buffer resolutions to fit in size.\n"
+		"      --crop <w>x<h>+<x>+<y>\n"
+		"                         Only use this part of the image.\n"
+		"      --decode-helper    Decode images in a short-lived process.\n"
+		"      --progressive      Show a quick preview while images decode.\n"
+		"      --config <file>    Read per-output settings from file.\n"
 		"\n"
 		"Background Modes:\n"
-		"  stretch, fit, fill, center, tile, or solid_color\n";
+		"  stretch, fit, fill, center, tile, span, or solid_color\n";
 
-	struct swaybg_output_config *config = calloc(1, sizeof(struct swaybg_output_config));
-	config->output = strdup("*");
-	config->mode = BACKGROUND_MODE_INVALID;
-	wl_list_init(&config->link); // init for safe removal
+	// Config files form the bottom layer: read them all first, so that
+	// options on the command line are merged on top wherever they are
+	for (int i = 1; i < argc; ++i) {
+		const char *path = NULL;
+		if (!find_config_arg(argc, argv, long_options, &i, &path)) {
+			break;
+		}
+		if (path && !config_file_load(path, handle_config_line, state)) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct swaybg_output_config *config = create_output_config("*");
 
-	int c;
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "c:hi:m:o:v", long_options, &option_index);
+		int c = getopt_long(argc, argv, "c:e:hi:m:o:v", long_options, &option_index);
 		if (c == -1) {
 			break;
 		}
@@ -518,8 +1358,11 @@ static void parse_command_line(int argc, char **argv,
 				continue;
 			}
 			break;
+		case 'e':  // effect
+			parse_background_effects(optarg, &config->effects);
+			break;
 		case 'i':  // image
-			config->image_path = optarg;
+			config->image_path = intern_image_path(state, optarg);
 			break;
 		case 'm':  // mode
 			config->mode = parse_background_mode(optarg);
@@ -530,17 +1373,46 @@ static void parse_command_line(int argc, char **argv,
 		case 'o':  // output
 			if (config && !store_swaybg_output_config(state, config)) {
 				// Empty config or merged on top of an existing one
-				destroy_swaybg_output_config(config);
+				destroy_swaybg_output_config(state, config);
 			}
-			config = calloc(1, sizeof(struct swaybg_output_config));
-			config->output = strdup(optarg);
-			config->mode = BACKGROUND_MODE_INVALID;
-			wl_list_init(&config->link);  // init for safe removal
+			config = create_output_config(optarg);
 			break;
 		case 'v':  // version
 			fprintf(stdout, "swaybg version " SWAYBG_VERSION "\n");
 			exit(EXIT_SUCCESS);
 			break;
+		case OPT_TRACE:
+			swaybg_trace_init(optarg);
+			break;
+		case OPT_TRANSITION: {
+			char *end;
+			unsigned long ms = strtoul(optarg, &end, 10);
+			if (!isdigit(*optarg) || *end != '\0' || ms > UINT32_MAX) {
+				swaybg_log(LOG_ERROR, "Invalid transition duration: %s", optarg);
+				continue;
+			}
+			state->transition_ms = ms;
+			break;
+		}
+		case OPT_MEMORY_BUDGET:
+			if (!parse_size(optarg, &state->memory_budget)) {
+				swaybg_log(LOG_ERROR, "Invalid memory budget: %s", optarg);
+			}
+			break;
+		case OPT_CROP:
+			if (!parse_image_crop(optarg, &config->crop)) {
+				swaybg_log(LOG_ERROR, "Invalid crop: %s", optarg);
+			}
+			break;
+		case OPT_DECODE_HELPER:
+			state->decode_helper = true;
+			break;
+		case OPT_PROGRESSIVE:
+			state->progressive = true;
+			break;
+		case OPT_CONFIG:
+			// Already read
+			break;
 		default:
 			fprintf(c == 'h' ? stdout : stderr, "%s", usage);
 			exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
@@ -548,7 +1420,7 @@ static void parse_command_line(int argc, char **argv,
 	}
 	if (config && !store_swaybg_output_config(state, config)) {
 		// Empty config or merged on top of an existing one
-		destroy_swaybg_output_config(config);
+		destroy_swaybg_output_config(state, config);
 	}
 
 	// Check for invalid options
@@ -556,7 +1428,7 @@ static void parse_command_line(int argc, char **argv,
 		config = NULL;
 		struct swaybg_output_config *tmp = NULL;
 		wl_list_for_each_safe(config, tmp, &state->configs, link) {
-			destroy_swaybg_output_config(config);
+			destroy_swaybg_output_config(state, config);
 		}
 		// continue into empty list
 	}
@@ -570,17 +1442,447 @@ static void parse_command_line(int argc, char **argv,
 	struct swaybg_output_config *tmp = NULL;
 	wl_list_for_each_safe(config, tmp, &state->configs, link) {
 		if (!config->image_path && !config->color) {
-			destroy_swaybg_output_config(config);
+			destroy_swaybg_output_config(state, config);
 		} else if (config->mode == BACKGROUND_MODE_INVALID) {
 			config->mode = config->image_path
 				? BACKGROUND_MODE_STRETCH
 				: BACKGROUND_MODE_SOLID_COLOR;
 		}
 	}
+
+	// Patterns are tried in the order they were first given
+	size_t n_configs = wl_list_length(&state->configs);
+	state->glob_configs = calloc(n_configs, sizeof(*state->glob_configs));
+	if (!state->glob_configs) {
+		swaybg_log(LOG_ERROR, "Failed to allocate output patterns");
+		exit(EXIT_FAILURE);
+	}
+	wl_list_for_each_reverse(config, &state->configs, link) {
+		if (is_glob_config(config)) {
+			state->glob_configs[state->n_glob_configs++] = config;
+		}
+	}
+}
+
+struct budget_entry {
+	struct swaybg_output *output;
+	double area;  // visible, in logical pixels
+	double bytes; // for a full resolution buffer
+};
+
+static int compare_budget_entries(const void *a, const void *b) {
+	const struct budget_entry *ea = a, *eb = b;
+	double da = ea->bytes / ea->area, db = eb->bytes / eb->area;
+	return (da > db) - (da < db);
+}
+
+/*
+ * Share the memory budget between outputs in proportion to their visible
+ * area, and lower the resolution of those whose buffers would not fit. An
+ * output needing less than its share leaves the rest to the others.
+ */
+static void apply_memory_budget(struct swaybg_state *state) {
+	if (!state->memory_budget) {
+		return;
+	}
+	struct budget_entry *entries = calloc(wl_list_length(&state->outputs),
+		sizeof(*entries));
+	if (!entries) {
+		return;
+	}
+
+	size_t n = 0;
+	double total_area = 0;
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		uint32_t width, height;
+		get_full_buffer_size(output, &width, &height);
+		if (!output->viewport || output->width == 0 || width * height <= 1) {
+			// Not configured yet, or cannot be scaled
+			continue;
+		}
+		entries[n] = (struct budget_entry){
+			.output = output,
+			.area = (double)output->width * output->height,
+			.bytes = (double)width * height * 4,
+		};
+		total_area += entries[n++].area;
+	}
+	// Water-filling: the outputs needing the least per area go first
+	qsort(entries, n, sizeof(*entries), compare_budget_entries);
+
+	double remaining = state->memory_budget;
+	for (size_t i = 0; i < n; ++i) {
+		struct budget_entry *entry = &entries[i];
+		double share = remaining * entry->area / total_area;
+		double granted = entry->bytes < share ? entry->bytes : share;
+		remaining -= granted;
+		total_area -= entry->area;
+
+		output = entry->output;
+		double resolution = granted < entry->bytes ?
+			sqrt(granted / entry->bytes) : 1;
+		if (resolution != output->resolution) {
+			output->resolution = resolution;
+			output->dirty = true;
+			uint32_t width, height;
+			get_buffer_size(output, &width, &height);
+			swaybg_log(LOG_INFO, "Output %s: %ux%u buffer, %.0f%% of full "
+				"resolution, for a %.1f MiB share of the memory budget",
+				output->name, width, height, resolution * 100,
+				granted / (1 << 20));
+		}
+	}
+	free(entries);
+}
+
+// Previews are decoded for targets this many times smaller, the most JPEG
+// can reduce by while decoding
+#define PREVIEW_DIVISOR 8
+
+static struct background_image *load_image(struct swaybg_state *state,
+		struct swaybg_image *image,
+		const struct background_target *targets, size_t n_targets) {
+	if (state->decode_helper) {
+		return load_background_image_isolated(&image->file, image->crop,
+			targets, n_targets);
+	}
+	return load_background_image(&image->file, image->crop,
+		targets, n_targets);
+}
+
+/*
+ * Decode `image` for targets a fraction of the size, which formats that
+ * can decode at a reduced size do quickly, and unless that is all the
+ * targets need, start decoding it in full on a thread. Returns the preview
+ * to draw in the meantime.
+ */
+static struct background_image *load_preview(struct swaybg_state *state,
+		struct swaybg_image *image,
+		const struct background_target *targets, size_t n_targets) {
+	struct background_target *small = calloc(n_targets, sizeof(*small));
+	if (!small) {
+		return NULL;
+	}
+	for (size_t i = 0; i < n_targets; ++i) {
+		small[i] = targets[i];
+		if (targets[i].mode != BACKGROUND_MODE_CENTER &&
+				targets[i].mode != BACKGROUND_MODE_TILE) {
+			// Shown at the same scale whatever the size in these modes
+			small[i].width = (targets[i].width + PREVIEW_DIVISOR - 1) /
+				PREVIEW_DIVISOR;
+			small[i].height = (targets[i].height + PREVIEW_DIVISOR - 1) /
+				PREVIEW_DIVISOR;
+		}
+	}
+	swaybg_trace_begin("load_preview");
+	struct background_image *bg = load_image(state, image, small, n_targets);
+	swaybg_trace_end("load_preview");
+	free(small);
+	if (bg && background_image_fits(bg, targets, n_targets)) {
+		return bg;
+	}
+
+	image->decode_thread = decode_thread_start(&image->file, image->crop,
+		targets, n_targets, state->decode_helper, state->decode_done);
+	if (!image->decode_thread) {
+		destroy_background_image(bg);
+		return NULL;
+	}
+	return bg;
+}
+
+// Acknowledge configures, then load images and render dirty outputs
+static void update_outputs(struct swaybg_state *state) {
+	struct swaybg_image *image;
+
+	apply_memory_budget(state);
+
+	// Send acks, and determine which images need to be loaded
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->needs_ack) {
+			output->needs_ack = false;
+			zwlr_layer_surface_v1_ack_configure(
+					output->layer_surface,
+					output->configure_serial);
+		}
+
+		if (output->dirty && !output->powered_off &&
+				output->config->image && buffer_needs_redraw(output)) {
+			output->config->image->load_required = true;
+		}
+	}
+
+	// Load images unless the last decode still fits, and render associated
+	// frames
+	wl_list_for_each(image, &state->images, link) {
+		if (!image->load_required) {
+			continue;
+		}
+
+		size_t n_targets = 0;
+		struct background_target *targets = calloc(
+			wl_list_length(&state->outputs), sizeof(*targets));
+		wl_list_for_each(output, &state->outputs, link) {
+			if (targets && output->dirty && !output->powered_off &&
+					output->config->image == image) {
+				// Targets are upright, and span the whole span
+				uint32_t buffer_width, buffer_height;
+				get_buffer_size(output, &buffer_width, &buffer_height);
+				if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+					uint32_t tmp = buffer_width;
+					buffer_width = buffer_height;
+					buffer_height = tmp;
+				}
+				struct layout_box area = get_image_area(output,
+					buffer_width, buffer_height);
+				targets[n_targets++] = (struct background_target){
+					.mode = output->config->mode,
+					.width = area.width,
+					.height = area.height,
+				};
+			}
+		}
+
+		struct background_image *bg = image->decoded;
+		if (image->decode_thread) {
+			// Draw the preview until the full decode is done
+		} else if (!bg || !targets ||
+				!background_image_fits(bg, targets, n_targets)) {
+			destroy_background_image(bg);
+			bg = NULL;
+			if (state->progressive && targets) {
+				bg = load_preview(state, image, targets, n_targets);
+			}
+			if (!bg && !image->decode_thread) {
+				swaybg_trace_begin("load_background_image");
+				bg = load_image(state, image, targets, n_targets);
+				swaybg_trace_end("load_background_image");
+			}
+			image->decoded = bg;
+		}
+		free(targets);
+		if (!bg) {
+			if (!image->decode_thread) {
+				swaybg_log(LOG_ERROR, "Failed to load image: %s",
+					image->path);
+			}
+			continue;
+		}
+
+		struct timespec ready;
+		clock_gettime(CLOCK_MONOTONIC, &ready);
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->dirty && !output->powered_off &&
+					output->config->image == image) {
+				output->dirty = false;
+				output->frame.ready = ready;
+				render_frame(output, bg);
+			}
+		}
+
+		image->load_required = false;
+	}
+
+	// Redraw outputs without associated image
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->dirty && !output->powered_off) {
+			output->dirty = false;
+			clock_gettime(CLOCK_MONOTONIC, &output->frame.ready);
+			render_frame(output, NULL);
+		}
+	}
+}
+
+// Redraw the output on the next update even though its size did not change
+static void force_redraw(struct swaybg_output *output) {
+	if (output->buffer_width) {
+		output->buffer_width = output->buffer_height = 0;
+		output->dirty = true;
+	}
+}
+
+// Re-read every image from disk and redraw the outputs showing one
+static void reload_images(struct swaybg_state *state) {
+	swaybg_log(LOG_INFO, "Reloading images");
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (image->decode_thread) {
+			// It is reading the file
+			destroy_background_image(decode_thread_join(image->decode_thread));
+			image->decode_thread = NULL;
+		}
+		destroy_background_image(image->decoded);
+		image->decoded = NULL;
+		image_file_close(&image->file);
+		image_file_open(&image->file, image->path);
+	}
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->config && output->config->image) {
+			force_redraw(output);
+		}
+	}
+}
+
+// Flush requests, waiting for the socket to drain if it is full
+static void flush_display(struct swaybg_state *state) {
+	uint32_t events = EPOLLIN;
+	if (wl_display_flush(state->display) < 0 && errno == EAGAIN) {
+		events |= EPOLLOUT;
+	}
+	if (events != state->display_events &&
+			event_source_update_fd(state->display_source, events)) {
+		state->display_events = events;
+	}
+}
+
+static void handle_display_event(uint32_t events, void *data) {
+	struct swaybg_state *state = data;
+	if (events & EPOLLOUT) {
+		flush_display(state);
+	}
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		state->display_read = true;
+		if (wl_display_read_events(state->display) < 0) {
+			swaybg_log_errno(LOG_ERROR, "Failed to read Wayland events");
+			state->run_display = false;
+		}
+	}
+}
+
+static void handle_exit_signal(uint32_t events, void *data) {
+	struct swaybg_state *state = data;
+	state->run_display = false;
+}
+
+static void handle_reload_signal(uint32_t events, void *data) {
+	reload_images(data);
+}
+
+// Replace previews with the images decoded in full
+static void handle_decode_done(uint32_t events, void *data) {
+	struct swaybg_state *state = data;
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (!image->decode_thread ||
+				!decode_thread_finished(image->decode_thread)) {
+			continue;
+		}
+		struct background_image *bg =
+			decode_thread_join(image->decode_thread);
+		image->decode_thread = NULL;
+		if (!bg) {
+			swaybg_log(LOG_ERROR, "Failed to load image: %s", image->path);
+			continue;
+		}
+		destroy_background_image(image->decoded);
+		image->decoded = bg;
+		struct swaybg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			// Outputs are only matched to a config once done
+			if (output->config && output->config->image == image) {
+				force_redraw(output);
+			}
+		}
+	}
+}
+
+// Pressure keeps being reported while it lasts; reclaim at most this often,
+// in seconds
+#define RECLAIM_INTERVAL 2
+
+/*
+ * Drop the decoded images and the buffers kept for transitions, which are
+ * decoded and drawn again when next needed, and hand the freed memory back.
+ */
+static void handle_memory_pressure(const char *reason, void *data) {
+	struct swaybg_state *state = data;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (state->last_reclaim.tv_sec != 0 &&
+			now.tv_sec - state->last_reclaim.tv_sec < RECLAIM_INTERVAL) {
+		return;
+	}
+	state->last_reclaim = now;
+	size_t before = memory_resident_bytes();
+
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (image->decode_thread) {
+			// Still decoding, and showing the preview meanwhile
+			continue;
+		}
+		destroy_background_image(image->decoded);
+		image->decoded = NULL;
+	}
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->transition) {
+			continue;
+		}
+		// The next image change is shown without a fade
+		destroy_buffer(&output->current);
+		output->current = (struct pool_buffer){0};
+	}
+#if HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+
+	size_t after = memory_resident_bytes();
+	swaybg_log(LOG_INFO, "Reclaimed %zu bytes on %s (resident: %zu bytes)",
+		before > after ? before - after : 0, reason, after);
+}
+
+/*
+ * Sleep until the Wayland socket or any other event source is ready, run
+ * the handlers, and dispatch Wayland events. Returns false once the display
+ * connection fails.
+ */
+static bool dispatch_events(struct swaybg_state *state) {
+	while (wl_display_prepare_read(state->display) != 0) {
+		if (wl_display_dispatch_pending(state->display) < 0) {
+			return false;
+		}
+	}
+	flush_display(state);
+
+	state->display_read = false;
+	int ret = event_loop_poll(state->loop, -1);
+	if (!state->display_read) {
+		wl_display_cancel_read(state->display);
+	}
+	if (ret < 0) {
+		return false;
+	}
+	return wl_display_dispatch_pending(state->display) >= 0;
+}
+
+/*
+ * The key telling images apart: the crop, if any, then a space and the
+ * path. A crop has no spaces, so no two images share a key.
+ */
+static char *get_image_key(const char *path, const struct image_crop *crop) {
+	char prefix[64] = "";
+	if (crop) {
+		snprintf(prefix, sizeof(prefix), "%dx%d+%d+%d",
+			crop->width, crop->height, crop->x, crop->y);
+	}
+	size_t size = strlen(prefix) + 1 + strlen(path) + 1;
+	char *key = malloc(size);
+	if (key) {
+		snprintf(key, size, "%s %s", prefix, path);
+	}
+	return key;
 }
 
 int main(int argc, char **argv) {
+	presentation_clock_start();
 	swaybg_log_init(LOG_DEBUG);
+	if (argc == 2 && strcmp(argv[1], DECODE_HELPER_ARG) == 0) {
+		return decode_helper_main();
+	}
 
 	struct swaybg_state state = {0};
 	wl_list_init(&state.configs);
@@ -589,26 +1891,38 @@ int main(int argc, char **argv) {
 
 	parse_command_line(argc, argv, &state);
 
-	// Identify distinct image paths which will need to be loaded
+	// Identify distinct images which will need to be loaded
+	struct hash_table image_table = {0};
 	struct swaybg_image *image;
 	struct swaybg_output_config *config;
 	wl_list_for_each(config, &state.configs, link) {
 		if (!config->image_path) {
 			continue;
 		}
-		wl_list_for_each(image, &state.images, link) {
-			if (strcmp(image->path, config->image_path) == 0) {
-				config->image = image;
-				break;
-			}
-		}
+		const struct image_crop *crop =
+			config->crop.width ? &config->crop : NULL;
+		char *key = get_image_key(config->image_path, crop);
+		config->image = key ? hash_table_get(&image_table, key) : NULL;
 		if (config->image) {
+			free(key);
 			continue;
 		}
 		image = calloc(1, sizeof(struct swaybg_image));
 		image->path = config->image_path;
+		image->crop = crop;
 		wl_list_insert(&state.images, &image->link);
 		config->image = image;
+		// Failing only costs loading the image again for the next config
+		if (key) {
+			hash_table_set(&image_table, key, image);
+		}
+		free(key);
+	}
+	hash_table_finish(&image_table);
+
+	// Get the files read in while connecting and waiting for the outputs
+	wl_list_for_each(image, &state.images, link) {
+		image_file_open(&image->file, image->path);
 	}
 
 	state.display = wl_display_connect(NULL);
@@ -631,59 +1945,47 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	state.run_display = true;
-	while (wl_display_dispatch(state.display) != -1 && state.run_display) {
-		// Send acks, and determine which images need to be loaded
-		struct swaybg_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			if (output->needs_ack) {
-				output->needs_ack = false;
-				zwlr_layer_surface_v1_ack_configure(
-						output->layer_surface,
-						output->configure_serial);
-			}
-
-			if (output->dirty) {
-				uint32_t buffer_width, buffer_height;
-				get_buffer_size(output, &buffer_width, &buffer_height);
-				bool buffer_change = output->buffer_width != buffer_width ||
-					output->buffer_height != buffer_height;
-				if (output->config->image && buffer_change) {
-					output->config->image->load_required = true;
-				}
-			}
+	state.loop = event_loop_create();
+	if (!state.loop) {
+		return 1;
+	}
+	state.display_events = EPOLLIN;
+	state.display_source = event_loop_add_fd(state.loop,
+		wl_display_get_fd(state.display), state.display_events,
+		handle_display_event, &state);
+	if (!state.display_source) {
+		return 1;
+	}
+	// Block these before any thread is started, so it cannot receive them
+	struct {
+		int signal;
+		event_handler_t handler;
+	} signals[] = {
+		{ SIGINT, handle_exit_signal },
+		{ SIGTERM, handle_exit_signal },
+		{ SIGHUP, handle_reload_signal },
+		{ SIGUSR1, handle_reload_signal },
+	};
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+		if (!event_loop_add_signal(state.loop, signals[i].signal,
+				signals[i].handler, &state)) {
+			return 1;
 		}
-
-		// Load images, render associated frames, and unload
-		wl_list_for_each(image, &state.images, link) {
-			if (!image->load_required) {
-				continue;
-			}
-
-			cairo_surface_t *surface = load_background_image(image->path);
-			if (!surface) {
-				swaybg_log(LOG_ERROR, "Failed to load image: %s", image->path);
-				continue;
-			}
-
-			wl_list_for_each(output, &state.outputs, link) {
-				if (output->dirty && output->config->image == image) {
-					output->dirty = false;
-					render_frame(output, surface);
-				}
-			}
-
-			image->load_required = false;
-			cairo_surface_destroy(surface);
+	}
+	if (state.progressive) {
+		state.decode_done = event_loop_add_event(state.loop,
+			handle_decode_done, &state);
+		if (!state.decode_done) {
+			state.progressive = false;
 		}
+	}
 
-		// Redraw outputs without associated image
-		wl_list_for_each(output, &state.outputs, link) {
-			if (output->dirty) {
-				output->dirty = false;
-				render_frame(output, NULL);
-			}
-		}
+	state.memory_monitor = memory_monitor_create(state.loop,
+		handle_memory_pressure, &state);
+
+	state.run_display = true;
+	while (dispatch_events(&state) && state.run_display) {
+		update_outputs(&state);
 	}
 
 	struct swaybg_output *output, *tmp_output;
@@ -693,13 +1995,18 @@ int main(int argc, char **argv) {
 
 	struct swaybg_output_config *tmp_config = NULL;
 	wl_list_for_each_safe(config, tmp_config, &state.configs, link) {
-		destroy_swaybg_output_config(config);
+		destroy_swaybg_output_config(&state, config);
 	}
+	hash_table_finish(&state.config_table);
+	free(state.glob_configs);
 
 	struct swaybg_image *tmp_image;
 	wl_list_for_each_safe(image, tmp_image, &state.images, link) {
 		destroy_swaybg_image(image);
 	}
+	hash_table_finish(&state.image_paths);
 
+	memory_monitor_destroy(state.memory_monitor);
+	event_loop_destroy(state.loop);
 	return 0;
 }
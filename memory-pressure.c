@@ -0,0 +1,225 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "log.h"
+#include "memory-pressure.h"
+
+#define PSI_MEMORY "/proc/pressure/memory"
+// Tasks stalled on memory for 150 ms of a 2 s window. Unprivileged
+// processes may only use windows that are a multiple of 2 s.
+#define PSI_TRIGGER "some 150000 2000000"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+struct memory_monitor {
+	memory_pressure_handler_t handler;
+	void *data;
+
+	int psi_fd;
+	struct event_source *psi;
+	int events_fd;
+	struct event_source *events;
+	// The high, max and oom events of the cgroup seen so far
+	uint64_t events_count;
+};
+
+static void close_psi(struct memory_monitor *monitor) {
+	event_source_remove(monitor->psi);
+	monitor->psi = NULL;
+	if (monitor->psi_fd >= 0) {
+		close(monitor->psi_fd);
+		monitor->psi_fd = -1;
+	}
+}
+
+static void close_events(struct memory_monitor *monitor) {
+	event_source_remove(monitor->events);
+	monitor->events = NULL;
+	if (monitor->events_fd >= 0) {
+		close(monitor->events_fd);
+		monitor->events_fd = -1;
+	}
+}
+
+static void handle_psi(uint32_t events, void *data) {
+	struct memory_monitor *monitor = data;
+	if (events & EPOLLERR) {
+		// The trigger is gone, e.g. PSI was disabled
+		swaybg_log(LOG_DEBUG, "Memory pressure trigger stopped working");
+		close_psi(monitor);
+		return;
+	}
+	if (events & EPOLLPRI) {
+		monitor->handler("memory pressure stall", monitor->data);
+	}
+}
+
+static bool open_psi(struct memory_monitor *monitor,
+		struct event_loop *loop) {
+	int fd = open(PSI_MEMORY, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to open %s", PSI_MEMORY);
+		return false;
+	}
+	if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to set a trigger on %s",
+			PSI_MEMORY);
+		close(fd);
+		return false;
+	}
+	monitor->psi_fd = fd;
+	// PSI files are always readable, only the trigger is signaled
+	monitor->psi = event_loop_add_fd(loop, fd, EPOLLPRI,
+		handle_psi, monitor);
+	if (!monitor->psi) {
+		close_psi(monitor);
+		return false;
+	}
+	return true;
+}
+
+// Read the sum of the high, max and oom counts in memory.events
+static bool read_events_count(int fd, uint64_t *count) {
+	char buf[512];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0) {
+		return false;
+	}
+	buf[len] = '\0';
+	*count = 0;
+	for (char *line = buf; line && *line; line = strchr(line, '\n')) {
+		line += *line == '\n';
+		char key[16];
+		uint64_t value;
+		if (sscanf(line, "%15s %" SCNu64, key, &value) == 2 &&
+				(strcmp(key, "high") == 0 || strcmp(key, "max") == 0 ||
+				strcmp(key, "oom") == 0)) {
+			*count += value;
+		}
+	}
+	return true;
+}
+
+static void handle_events(uint32_t events, void *data) {
+	struct memory_monitor *monitor = data;
+	// kernfs reports changes as EPOLLPRI | EPOLLERR; reading clears them
+	uint64_t count;
+	if (!read_events_count(monitor->events_fd, &count)) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to read cgroup memory events");
+		close_events(monitor);
+		return;
+	}
+	if (count > monitor->events_count) {
+		monitor->events_count = count;
+		monitor->handler("cgroup memory limit", monitor->data);
+	}
+}
+
+// Return the path of our cgroup v2 memory.events, or NULL
+static char *get_events_path(void) {
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (!f) {
+		return NULL;
+	}
+	char *line = NULL, *path = NULL;
+	size_t size = 0;
+	while (getline(&line, &size, f) > 0) {
+		if (strncmp(line, "0::", 3) != 0) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		// The root cgroup has no memory controller files
+		if (strcmp(line + 3, "/") != 0) {
+			size_t n = strlen(CGROUP_ROOT) + strlen(line + 3) +
+				strlen("/memory.events") + 1;
+			path = malloc(n);
+			if (path) {
+				snprintf(path, n, "%s%s/memory.events",
+					CGROUP_ROOT, line + 3);
+			}
+		}
+		break;
+	}
+	free(line);
+	fclose(f);
+	return path;
+}
+
+static bool open_events(struct memory_monitor *monitor,
+		struct event_loop *loop) {
+	char *path = get_events_path();
+	if (!path) {
+		return false;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to open %s", path);
+		free(path);
+		return false;
+	}
+	monitor->events_fd = fd;
+	if (!read_events_count(fd, &monitor->events_count)) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to read %s", path);
+		close_events(monitor);
+		free(path);
+		return false;
+	}
+	free(path);
+	monitor->events = event_loop_add_fd(loop, fd, EPOLLPRI,
+		handle_events, monitor);
+	if (!monitor->events) {
+		close_events(monitor);
+		return false;
+	}
+	return true;
+}
+
+struct memory_monitor *memory_monitor_create(struct event_loop *loop,
+		memory_pressure_handler_t handler, void *data) {
+	struct memory_monitor *monitor = calloc(1, sizeof(struct memory_monitor));
+	if (!monitor) {
+		swaybg_log(LOG_ERROR, "Failed to allocate memory monitor");
+		return NULL;
+	}
+	monitor->handler = handler;
+	monitor->data = data;
+	monitor->psi_fd = monitor->events_fd = -1;
+
+	bool psi = open_psi(monitor, loop);
+	bool events = open_events(monitor, loop);
+	if (!psi && !events) {
+		swaybg_log(LOG_DEBUG, "Memory pressure cannot be monitored");
+		free(monitor);
+		return NULL;
+	}
+	swaybg_log(LOG_DEBUG, "Monitoring memory pressure%s%s",
+		psi ? " (PSI)" : "", events ? " (cgroup events)" : "");
+	return monitor;
+}
+
+void memory_monitor_destroy(struct memory_monitor *monitor) {
+	if (!monitor) {
+		return;
+	}
+	close_psi(monitor);
+	close_events(monitor);
+	free(monitor);
+}
+
+size_t memory_resident_bytes(void) {
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (!f) {
+		return 0;
+	}
+	unsigned long size, resident;
+	int n = fscanf(f, "%lu %lu", &size, &resident);
+	fclose(f);
+	if (n != 2) {
+		return 0;
+	}
+	return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
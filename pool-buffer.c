@@ -1,4 +1,3 @@
-#include <assert.h>
 #include <cairo.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -9,6 +8,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "log.h"
 #include "pool-buffer.h"
 
 static int anonymous_shm_open(void) {
@@ -36,20 +36,48 @@ static int anonymous_shm_open(void) {
 	return -1;
 }
 
+/*
+ * Open a shm file of `size` bytes. The memory is allocated up front where
+ * possible, so that running out of it fails here rather than with SIGBUS
+ * on first write.
+ */
+static int allocate_shm_file(size_t size) {
+	int fd = anonymous_shm_open();
+	if (fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create shm file");
+		return -1;
+	}
+
+	int ret = posix_fallocate(fd, 0, size);
+	if (ret == EINVAL || ret == EOPNOTSUPP) {
+		// Not supported for shm on this system
+		ret = ftruncate(fd, size) < 0 ? errno : 0;
+	}
+	if (ret != 0) {
+		swaybg_log(LOG_ERROR, "Failed to allocate %zu bytes of shm: %s",
+			size, strerror(ret));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 bool create_buffer(struct pool_buffer *buf, struct wl_shm *shm,
 		int32_t width, int32_t height, uint32_t format) {
 	uint32_t stride = width * 4;
-	size_t size = stride * height;
+	size_t size = (size_t)stride * height;
 
-	int fd = anonymous_shm_open();
-	assert(fd != -1);
-
-	if (ftruncate(fd, size) < 0) {
-		close(fd);
+	int fd = allocate_shm_file(size);
+	if (fd < 0) {
 		return false;
 	}
 
 	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		swaybg_log_errno(LOG_ERROR, "Failed to map %zu bytes of shm", size);
+		close(fd);
+		return false;
+	}
 	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
 	buf->buffer = wl_shm_pool_create_buffer(pool, 0,
 			width, height, stride, format);
@@ -61,6 +89,48 @@ bool create_buffer(struct pool_buffer *buf, struct wl_shm *shm,
 	buf->surface = cairo_image_surface_create_for_data(data,
 			CAIRO_FORMAT_RGB24, width, height, stride);
 	buf->cairo = cairo_create(buf->surface);
+	if (cairo_status(buf->cairo) != CAIRO_STATUS_SUCCESS) {
+		swaybg_log(LOG_ERROR, "Failed to create %dx%d cairo surface: %s",
+			width, height, cairo_status_to_string(cairo_status(buf->cairo)));
+		destroy_buffer(buf);
+		return false;
+	}
+	return true;
+}
+
+bool create_buffers(struct pool_buffer *bufs, size_t n, struct wl_shm *shm,
+		int32_t width, int32_t height, uint32_t format) {
+	uint32_t stride = width * 4;
+	// Page-align each buffer so that destroy_buffer() can unmap it alone
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = ((size_t)stride * height + page - 1) / page * page;
+
+	int fd = allocate_shm_file(size * n);
+	if (fd < 0) {
+		return false;
+	}
+
+	uint8_t *data = mmap(NULL, size * n, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if (data == MAP_FAILED) {
+		swaybg_log_errno(LOG_ERROR, "Failed to map %zu bytes of shm",
+			size * n);
+		close(fd);
+		return false;
+	}
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size * n);
+	for (size_t i = 0; i < n; ++i) {
+		struct pool_buffer *buf = &bufs[i];
+		buf->buffer = wl_shm_pool_create_buffer(pool, size * i,
+				width, height, stride, format);
+		buf->size = size;
+		buf->data = data + size * i;
+		buf->surface = cairo_image_surface_create_for_data(buf->data,
+				CAIRO_FORMAT_RGB24, width, height, stride);
+		buf->cairo = cairo_create(buf->surface);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
 	return true;
 }
 
@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "log.h"
+#include "presentation.h"
+#include "trace.h"
+
+struct frame_feedback {
+	struct wp_presentation_feedback *feedback;
+	char *const *name;
+	struct frame_times times;
+	struct presentation_stats *stats;
+	struct wl_list link;
+};
+
+static struct timespec start_time;
+// The clock presentation timestamps are in
+static clockid_t presentation_clock = CLOCK_MONOTONIC;
+
+static double timespec_to_ms(const struct timespec *ts) {
+	return ts->tv_sec * 1e3 + ts->tv_nsec / 1e6;
+}
+
+static void add_latency(struct latency_stats *stats, double ms) {
+	if (stats->count == 0 || ms < stats->min) {
+		stats->min = ms;
+	}
+	if (stats->count == 0 || ms > stats->max) {
+		stats->max = ms;
+	}
+	stats->total += ms;
+	++stats->count;
+}
+
+void presentation_clock_start(void) {
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+static void presentation_clock_id(void *data,
+		struct wp_presentation *presentation, uint32_t clk_id) {
+	presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_clock_id,
+};
+
+void presentation_init(struct wp_presentation *presentation) {
+	wp_presentation_add_listener(presentation, &presentation_listener, NULL);
+}
+
+static void destroy_frame_feedback(struct frame_feedback *frame) {
+	wl_list_remove(&frame->link);
+	wp_presentation_feedback_destroy(frame->feedback);
+	free(frame);
+}
+
+static void feedback_sync_output(void *data,
+		struct wp_presentation_feedback *feedback, struct wl_output *output) {
+	// The surface is only ever on its own output
+}
+
+static void feedback_presented(void *data,
+		struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	struct frame_feedback *frame = data;
+	struct presentation_stats *stats = frame->stats;
+
+	// Timestamps are in the compositor's clock, take them to ours
+	struct timespec now, monotonic_now;
+	clock_gettime(presentation_clock, &now);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+	struct timespec presented = {
+		.tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo,
+		.tv_nsec = tv_nsec,
+	};
+	double presented_ms = timespec_to_ms(&presented) -
+		timespec_to_ms(&now) + timespec_to_ms(&monotonic_now);
+
+	const char *name = *frame->name ? *frame->name : "(unnamed)";
+	if (stats->presented++ == 0) {
+		stats->first = presented_ms - timespec_to_ms(&start_time);
+		swaybg_log(LOG_DEBUG, "Output %s: first frame presented %.1f ms "
+			"after start", name, stats->first);
+	}
+	const char *kind = flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY ?
+		" (zero-copy)" : "";
+	double ready_ms = presented_ms - timespec_to_ms(&frame->times.ready);
+	add_latency(&stats->ready, ready_ms);
+	if (frame->times.configure.tv_sec || frame->times.configure.tv_nsec) {
+		double ms = presented_ms - timespec_to_ms(&frame->times.configure);
+		add_latency(&stats->configure, ms);
+		swaybg_log(LOG_DEBUG, "Output %s: frame presented %.1f ms after "
+			"configure, %.1f ms after its image was ready%s",
+			name, ms, ready_ms, kind);
+	} else {
+		swaybg_log(LOG_DEBUG, "Output %s: frame presented %.1f ms after its "
+			"image was ready%s", name, ready_ms, kind);
+	}
+	swaybg_trace_instant("presented", "%s %.3f ms", name, ready_ms);
+	destroy_frame_feedback(frame);
+}
+
+static void feedback_discarded(void *data,
+		struct wp_presentation_feedback *feedback) {
+	struct frame_feedback *frame = data;
+	++frame->stats->discarded;
+	destroy_frame_feedback(frame);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = feedback_sync_output,
+	.presented = feedback_presented,
+	.discarded = feedback_discarded,
+};
+
+void presentation_request_feedback(struct wp_presentation *presentation,
+		struct wl_surface *surface, char *const *name,
+		const struct frame_times *times, struct presentation_stats *stats,
+		struct wl_list *pending) {
+	struct frame_feedback *frame = calloc(1, sizeof(struct frame_feedback));
+	if (!frame) {
+		swaybg_log(LOG_ERROR, "Failed to allocate presentation feedback");
+		return;
+	}
+	frame->feedback = wp_presentation_feedback(presentation, surface);
+	frame->name = name;
+	frame->times = *times;
+	frame->stats = stats;
+	wp_presentation_feedback_add_listener(frame->feedback,
+		&feedback_listener, frame);
+	wl_list_insert(pending, &frame->link);
+}
+
+void presentation_cancel_feedback(struct wl_list *pending) {
+	struct frame_feedback *frame, *tmp;
+	wl_list_for_each_safe(frame, tmp, pending, link) {
+		destroy_frame_feedback(frame);
+	}
+}
+
+static void log_latency(const char *name, const char *what,
+		const struct latency_stats *stats) {
+	if (stats->count == 0) {
+		return;
+	}
+	swaybg_log(LOG_INFO, "Output %s: %s: min %.1f ms, mean %.1f ms, "
+		"max %.1f ms over %d frames", name, what, stats->min,
+		stats->total / stats->count, stats->max, stats->count);
+}
+
+void presentation_log_summary(const char *name,
+		const struct presentation_stats *stats) {
+	if (stats->presented == 0 && stats->discarded == 0) {
+		return;
+	}
+	name = name ? name : "(unnamed)";
+	swaybg_log(LOG_INFO, "Output %s: %d frames presented, %d discarded",
+		name, stats->presented, stats->discarded);
+	if (stats->presented > 0) {
+		swaybg_log(LOG_INFO, "Output %s: first frame presented %.1f ms "
+			"after start", name, stats->first);
+	}
+	log_latency(name, "configure to present", &stats->configure);
+	log_latency(name, "image ready to present", &stats->ready);
+}
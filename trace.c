@@ -0,0 +1,102 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+bool _swaybg_trace_enabled = false;
+
+static FILE *trace_file = NULL;
+static pid_t trace_pid;
+// Threads are told apart by made-up ids, the main thread's being the pid
+static _Thread_local int trace_tid;
+static atomic_int trace_threads;
+
+static double trace_timestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void trace_write_string(const char *str) {
+	fputc('"', trace_file);
+	for (const char *c = str; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(trace_file, "\\%c", *c);
+		} else if ((unsigned char)*c < 0x20) {
+			fprintf(trace_file, "\\u%04x", (unsigned char)*c);
+		} else {
+			fputc(*c, trace_file);
+		}
+	}
+	fputc('"', trace_file);
+}
+
+static void trace_finish(void) {
+	if (!trace_file) {
+		return;
+	}
+	fprintf(trace_file, "\n]\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	_swaybg_trace_enabled = false;
+}
+
+bool swaybg_trace_init(const char *path) {
+	// Given again, the last file wins and the previous one is completed
+	static bool registered = false;
+	trace_finish();
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		swaybg_log_errno(LOG_ERROR, "Failed to open trace file %s", path);
+		return false;
+	}
+	trace_pid = getpid();
+	trace_tid = trace_pid;
+	atomic_store(&trace_threads, 1);
+	fprintf(trace_file, "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"swaybg\"}}",
+		trace_pid, trace_pid);
+	if (!registered) {
+		atexit(trace_finish);
+		registered = true;
+	}
+	_swaybg_trace_enabled = true;
+	return true;
+}
+
+// Callers hold the lock on trace_file, so events from threads do not mix
+static void trace_event_start(char phase, const char *name) {
+	if (!trace_tid) {
+		trace_tid = trace_pid + atomic_fetch_add(&trace_threads, 1);
+	}
+	fprintf(trace_file, ",\n{\"name\":");
+	trace_write_string(name);
+	fprintf(trace_file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+		phase, trace_timestamp(), trace_pid, trace_tid);
+}
+
+void _swaybg_trace_span(char phase, const char *name) {
+	flockfile(trace_file);
+	trace_event_start(phase, name);
+	fprintf(trace_file, "}");
+	funlockfile(trace_file);
+}
+
+void _swaybg_trace_instant(const char *name, const char *fmt, ...) {
+	char detail[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(detail, sizeof(detail), fmt, args);
+	va_end(args);
+
+	flockfile(trace_file);
+	trace_event_start('i', name);
+	fprintf(trace_file, ",\"s\":\"p\",\"args\":{\"detail\":");
+	trace_write_string(detail);
+	fprintf(trace_file, "}}");
+	funlockfile(trace_file);
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "trace.h"
+#include "transition.h"
+
+// Four pixels, as bytes and widened so that a weighted sum fits in each lane
+typedef uint8_t pixels_u8 __attribute__((vector_size(16)));
+typedef uint16_t pixels_u16 __attribute__((vector_size(32)));
+
+void blend_pixels(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+		size_t n, uint32_t t) {
+	// 255 * 256 + 128 still fits in 16 bits, so nothing can overflow
+	uint16_t ta = 256 - t, tb = t;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		pixels_u8 va, vb;
+		memcpy(&va, a + i, sizeof(va));
+		memcpy(&vb, b + i, sizeof(vb));
+		pixels_u16 sum = __builtin_convertvector(va, pixels_u16) * ta +
+			__builtin_convertvector(vb, pixels_u16) * tb + 128;
+		pixels_u8 out = __builtin_convertvector(sum >> 8, pixels_u8);
+		memcpy(dst + i, &out, sizeof(out));
+	}
+	for (; i < n; ++i) {
+		// Same arithmetic, two channels per multiply
+		uint32_t pa = a[i], pb = b[i];
+		uint32_t rb = ((pa & 0xFF00FF) * ta + (pb & 0xFF00FF) * tb +
+			0x800080) >> 8 & 0xFF00FF;
+		uint32_t ag = ((pa >> 8 & 0xFF00FF) * ta + (pb >> 8 & 0xFF00FF) * tb +
+			0x800080) & 0xFF00FF00;
+		dst[i] = ag | rb;
+	}
+}
+
+static void buffer_release(void *data, struct wl_buffer *buffer) {
+	struct transition *transition = data;
+	for (size_t i = 0; i < 2; ++i) {
+		if (transition->frames[i].buffer == buffer) {
+			transition->busy[i] = false;
+		}
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_release,
+};
+
+static const struct wl_callback_listener frame_listener;
+
+static void request_frame(struct transition *transition) {
+	transition->frame_callback = wl_surface_frame(transition->surface);
+	wl_callback_add_listener(transition->frame_callback, &frame_listener,
+		transition);
+}
+
+static void attach(struct transition *transition, struct wl_buffer *buffer) {
+	wl_surface_attach(transition->surface, buffer, 0, 0);
+	wl_surface_damage_buffer(transition->surface, 0, 0,
+		transition->width, transition->height);
+}
+
+static void finish(struct transition *transition) {
+	attach(transition, transition->to.buffer);
+	wl_surface_commit(transition->surface);
+
+	struct pool_buffer to = transition->to;
+	memset(&transition->to, 0, sizeof(transition->to));
+	transition->done(&to, transition->data);
+	transition_destroy(transition);
+}
+
+static bool create_frames(struct transition *transition) {
+	if (!create_buffers(transition->frames, 2, transition->shm,
+			transition->width, transition->height, WL_SHM_FORMAT_XRGB8888)) {
+		swaybg_log(LOG_ERROR, "Failed to create transition buffers");
+		return false;
+	}
+	for (size_t i = 0; i < 2; ++i) {
+		wl_buffer_add_listener(transition->frames[i].buffer,
+			&buffer_listener, transition);
+	}
+	return true;
+}
+
+static void frame_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct transition *transition = data;
+	wl_callback_destroy(callback);
+	transition->frame_callback = NULL;
+
+	if (!transition->started) {
+		transition->started = true;
+		transition->start = time;
+	}
+	uint32_t elapsed = time - transition->start;
+	if (elapsed >= transition->duration) {
+		finish(transition);
+		return;
+	}
+
+	if (!transition->frames[0].buffer && !create_frames(transition)) {
+		finish(transition);
+		return;
+	}
+
+	// If the compositor still holds both frames, skip this one
+	int i = !transition->busy[0] ? 0 : !transition->busy[1] ? 1 : -1;
+	if (i >= 0) {
+		struct pool_buffer *frame = &transition->frames[i];
+		uint32_t t = (uint64_t)elapsed * 256 / transition->duration;
+		swaybg_trace_begin("blend_pixels");
+		blend_pixels(frame->data, transition->from.data, transition->to.data,
+			(size_t)transition->width * transition->height, t);
+		swaybg_trace_end("blend_pixels");
+		attach(transition, frame->buffer);
+		transition->busy[i] = true;
+	}
+	request_frame(transition);
+	wl_surface_commit(transition->surface);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+struct transition *transition_start(struct wl_surface *surface,
+		struct wl_shm *shm, struct pool_buffer *from, struct pool_buffer *to,
+		int width, int height, uint32_t duration,
+		transition_done_func_t done, void *data) {
+	struct transition *transition = calloc(1, sizeof(*transition));
+	if (!transition) {
+		return NULL;
+	}
+	transition->surface = surface;
+	transition->shm = shm;
+	transition->width = width;
+	transition->height = height;
+	transition->duration = duration;
+	transition->done = done;
+	transition->data = data;
+
+	transition->from = *from;
+	transition->to = *to;
+	memset(from, 0, sizeof(*from));
+	memset(to, 0, sizeof(*to));
+
+	// The first callback only records the start time. Re-attaching the old
+	// image makes sure the compositor repaints and sends it. The caller
+	// commits the surface.
+	attach(transition, transition->from.buffer);
+	request_frame(transition);
+	return transition;
+}
+
+void transition_finish(struct transition *transition) {
+	finish(transition);
+}
+
+void transition_destroy(struct transition *transition) {
+	if (!transition) {
+		return;
+	}
+	if (transition->frame_callback) {
+		wl_callback_destroy(transition->frame_callback);
+	}
+	destroy_buffer(&transition->from);
+	destroy_buffer(&transition->to);
+	for (size_t i = 0; i < 2; ++i) {
+		destroy_buffer(&transition->frames[i]);
+	}
+	free(transition);
+}